@@ -0,0 +1,37 @@
+#!/bin/sh
+# Throughput of (+ 1 2). A loop of n iterations calls (+ a b) with a = 1
+# and b = 2, which the compiler can't work out ahead like it would the
+# literal (+ 1 2), and is timed against the same loop without the call.
+# The native code compiler is off, so the builtin is what gets called.
+#
+# usage : sh bench/arith.sh [lispy] [n]
+
+LISPY=${1:-./lispy}
+N=${2:-1000000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cat > "$DIR/add.lspy" <<LSPY
+(jit {threshold 0})
+(def {loop} (\\ {n a b} {if (== n 0) {0} {loop (- n (- (+ a b) 2)) a b}}))
+(loop $N 1 2)
+LSPY
+cat > "$DIR/base.lspy" <<LSPY
+(jit {threshold 0})
+(def {loop} (\\ {n a b} {if (== n 0) {0} {loop (- n (- a 0)) a b}}))
+(loop $N 1 2)
+LSPY
+
+ms() {
+  start=$(date +%s%N)
+  "$LISPY" "$1" > /dev/null
+  end=$(date +%s%N)
+  echo $(( (end - start) / 1000000 ))
+}
+
+add=$(ms "$DIR/add.lspy")
+base=$(ms "$DIR/base.lspy")
+awk -v n="$N" -v add="$add" -v base="$base" 'BEGIN {
+  printf "%d iterations : %d ms with (+ 1 2), %d ms without, %.1f ns per (+ 1 2)\n",
+    n, add, base, (add - base) * 1e6 / n
+}'
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Global lookups as the number of definitions grows. Loads N definitions,
+# then calls a function 200 x 1000 times that looks up the first and four
+# times the last of them, a million lookups. "defs" is the time to load
+# the definitions, "lookups" the time the calls add to that.
+#
+# usage : sh bench/env.sh [lispy] [N ...]
+
+LISPY=${1:-./lispy}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] || set -- 10 1000 10000 100000 1000000
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+ms() {
+  start=$(date +%s%N)
+  "$LISPY" "$@" > /dev/null
+  end=$(date +%s%N)
+  echo $(( (end - start) / 1000000 ))
+}
+
+for n in "$@"; do
+  awk -v n="$n" 'BEGIN { for (i = 0; i < n; i++) { printf "(def {s%d} %d)\n", i, i } }' \
+    > "$DIR/defs.lspy"
+  awk -v l="s$((n - 1))" 'BEGIN {
+    printf "(def {g} (\\ {n} {if (== n 0) {0} {+ s0 %s %s %s %s (g (- n 1))}}))\n", l, l, l, l
+    for (i = 0; i < 200; i++) { print "(g 1000)" }
+  }' > "$DIR/calls.lspy"
+  defs=$(ms "$DIR/defs.lspy")
+  both=$(ms "$DIR/defs.lspy" "$DIR/calls.lspy")
+  printf "%8d definitions : defs %6d ms, lookups %6d ms\n" "$n" "$defs" $((both - defs))
+done
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Collector throughput and pauses, slabs against plain malloc/free. Builds
+# 100 lists of (f n) that stay alive, then 300 more that each replace the
+# last, and reports the time spent collecting, the longest pause from
+# 'stats {gc}', and the time the whole run took.
+#
+# usage : sh bench/gc.sh [lispy] [lispy built with -DLISPY_MALLOC] [n]
+
+LISPY=${1:-./lispy}
+MALLOC=${2:-./lispy_malloc}
+N=${3:-1000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+awk -v n="$N" 'BEGIN {
+  print "(def {f} (\\ {n} {if (== n 0) {{}} {join {n {n} n} (f (- n 1))}}))"
+  for (i = 0; i < 100; i++) { printf "(def {keep%d} (f %d))\n", i, n }
+  for (i = 0; i < 300; i++) { printf "(def {r} (f %d))\n", n }
+  print "(stats {gc})"
+}' > "$DIR/gc.lspy"
+
+for b in "$LISPY" "$MALLOC"; do
+  start=$(date +%s%N)
+  "$b" "$DIR/gc.lspy" > "$DIR/out"
+  end=$(date +%s%N)
+  awk -v b="$b" -v ms=$(( (end - start) / 1000000 )) '
+    / pause / {
+      for (i = 1; i <= NF; i++) {
+        if ($i == "max")   { if ($(i + 1) + 0 > max) { max = $(i + 1) + 0 } }
+        if ($i == "total") { total += $(i + 1) }
+      }
+    }
+    END { printf "%-24s gc total %8.1f ms, max pause %6.1f ms, run %d ms\n", b, total, max, ms }
+  ' "$DIR/out"
+done
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Native code against the interpreter. Runs (fib 27) and a tail recursive
+# sum to 3000000 with 'jit {threshold 0}', which leaves everything to the
+# interpreter, and again with the default threshold.
+#
+# usage : sh bench/jit.sh [lispy]
+
+LISPY=${1:-./lispy}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cat > "$DIR/fib.lspy" <<'LSPY'
+(def {fib} (\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}}))
+(print (fib 27))
+LSPY
+cat > "$DIR/sum.lspy" <<'LSPY'
+(def {sum} (\ {n acc} {if (== n 0) {acc} {sum (- n 1) (+ acc n)}}))
+(print (sum 3000000 0))
+LSPY
+echo '(jit {threshold 0})' > "$DIR/off.lspy"
+
+ms() {
+  start=$(date +%s%N)
+  "$LISPY" "$@" > /dev/null
+  end=$(date +%s%N)
+  echo $(( (end - start) / 1000000 ))
+}
+
+for b in fib sum; do
+  off=$(ms "$DIR/off.lspy" "$DIR/$b.lspy")
+  on=$(ms "$DIR/$b.lspy")
+  printf "%-4s interpreted %6d ms, native %6d ms\n" "$b" "$off" "$on"
+done
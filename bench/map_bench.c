@@ -0,0 +1,176 @@
+#include "lispy.h"
+#include <time.h>
+
+/* Maps, see lmap.c.
+
+   'map_bench check' runs random inserts, lookups and deletes over a
+   small set of keys against a plain array holding what the map should
+   have, so that deletes keep leaving tombstones, dropping them and
+   reusing their slots. Then it fills a map with string keys. 'make test'
+   runs it built with the sanitizers.
+
+   'map_bench' times insert, hit, miss and delete per operation with
+   fixnum keys at 1k, 100k and 10M entries. */
+
+static unsigned long long rnd_state = 88172645463325252ull;
+
+/* Where timed lookups leave their results, so they aren't left out */
+static volatile long sink;
+
+/* xorshift, so every run does the same operations */
+static unsigned long long rnd(void)
+{
+  rnd_state ^= rnd_state << 13;
+  rnd_state ^= rnd_state >> 7;
+  rnd_state ^= rnd_state << 17;
+  return rnd_state;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int fail(char* what, int op)
+{
+  fprintf(stderr, "map : %s wrong at operation %d\n", what, op);
+  return 1;
+}
+
+/* Every key iteration finds is in ref with its value, and there are as
+   many as ref holds */
+static int check_all(lmap* m, long* ref, int keys, int count)
+{
+  int n = 0;
+  for (int i = lmap_next(m, 0); i >= 0; i = lmap_next(m, i + 1)) {
+    long k = LVAL_NUM_VAL(lmap_key(m, i));
+    if (k < 0 || k >= keys || ref[k] != LVAL_NUM_VAL(lmap_val(m, i))) { return 0; }
+    n++;
+  }
+  return n == count;
+}
+
+static int check_random(void)
+{
+  enum { KEYS = 5000, OPS = 2000000 };
+  long* ref = malloc(sizeof(long) * KEYS);
+  for (int i = 0; i < KEYS; i++) { ref[i] = -1; }
+
+  lmap* m = lmap_new();
+  int   count = 0;
+  for (int op = 0; op < OPS; op++) {
+    int   k   = rnd() % KEYS;
+    lval* key = lval_num(k);
+    switch (rnd() % 3) {
+      case 0: {
+        long v = rnd() % 1000;
+        lmap_put(m, key, lval_num(v));
+        if (ref[k] < 0) { count++; }
+        ref[k] = v;
+        break;
+      }
+      case 1: {
+        int found = lmap_remove(m, key);
+        lval_del(key);
+        if (found != (ref[k] >= 0)) { return fail("remove", op); }
+        if (found) { count--; }
+        ref[k] = -1;
+        break;
+      }
+      default: {
+        lval* v = lmap_get(m, key);
+        lval_del(key);
+        if ((v != NULL) != (ref[k] >= 0)) { return fail("get", op); }
+        if (v && LVAL_NUM_VAL(v) != ref[k]) { return fail("get value", op); }
+        break;
+      }
+    }
+    if (lmap_count(m) != count) { return fail("count", op); }
+
+    /* Now and then walk the whole table, and a copy of it */
+    if (op % 100000 == 0) {
+      lmap* c = lmap_copy(m);
+      if (!check_all(m, ref, KEYS, count)) { return fail("iteration", op); }
+      if (!check_all(c, ref, KEYS, count)) { return fail("copy", op); }
+      lmap_free(c);
+    }
+  }
+
+  lmap_free(m);
+  free(ref);
+  printf("map : %d random operations ok\n", OPS);
+  return 0;
+}
+
+static int check_strings(void)
+{
+  enum { KEYS = 100000 };
+  char  buf[32];
+  lmap* m = lmap_new();
+  for (int i = 0; i < KEYS; i++) {
+    sprintf(buf, "k%d", i);
+    lmap_put(m, lval_str(buf), lval_num(i));
+  }
+  for (int i = 0; i < KEYS; i++) {
+    sprintf(buf, "k%d", i);
+    lval* k = lval_str(buf);
+    lval* v = lmap_get(m, k);
+    lval_del(k);
+    if (!v || LVAL_NUM_VAL(v) != i) { return fail("string get", i); }
+  }
+  lmap_free(m);
+  printf("map : %d string keys ok\n", KEYS);
+  return 0;
+}
+
+static void bench(long n, int reps)
+{
+  double put = 0, hit = 0, miss = 0, del = 0;
+  long   sum = 0;
+
+  for (int r = 0; r < reps; r++) {
+    lmap*  m = lmap_new();
+    double t = now();
+    for (long i = 0; i < n; i++) { lmap_put(m, lval_num(i * 7919), lval_num(i)); }
+    put += now() - t;
+
+    t = now();
+    for (long i = 0; i < n; i++) { sum += LVAL_NUM_VAL(lmap_get(m, lval_num(i * 7919))); }
+    hit += now() - t;
+
+    t = now();
+    for (long i = 0; i < n; i++) { sum += lmap_get(m, lval_num(i * 7919 + 1)) != NULL; }
+    miss += now() - t;
+
+    t = now();
+    for (long i = 0; i < n; i++) { lmap_remove(m, lval_num(i * 7919)); }
+    del += now() - t;
+    lmap_free(m);
+  }
+  sink = sum;
+
+  /* Fixnum keys need no freeing, and ms * 1e6 / ops is ns per op */
+  double ops = (double)n * reps / 1000000.0;
+  printf("map : %8ld entries : insert %6.1f ns, hit %6.1f ns, miss %6.1f ns, "
+    "delete %6.1f ns\n", n, put / ops, hit / ops, miss / ops, del / ops);
+}
+
+int main(int argc, char** argv)
+{
+  lsym_init();
+
+  int failed = 0;
+  if (argc > 1 && strcmp(argv[1], "check") == 0) {
+    failed = check_random() || check_strings();
+  } else {
+    bench(1000, 2000);
+    bench(100000, 20);
+    bench(10000000, 1);
+  }
+
+  lalloc_cleanup();
+  lsym_cleanup();
+  return failed;
+}
@@ -0,0 +1,39 @@
+#!/bin/sh
+# Bytes per value of a one-million-element Q-expression. Loads
+# (def {big} {{} {} ...}) and compares 'stats {alloc}' with the same
+# definition of an empty list.
+#
+# usage : sh bench/mem.sh [lispy] [elements]
+
+LISPY=${1:-./lispy}
+N=${2:-1000000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+awk -v n="$N" 'BEGIN {
+  printf "(def {big} {"
+  for (i = 0; i < n; i++) { printf "{} " }
+  print "})"
+  print "(stats {alloc})"
+}' > "$DIR/big.lspy"
+printf '(def {big} {})\n(stats {alloc})\n' > "$DIR/empty.lspy"
+
+# live lvals, slabs, slab size and bytes per lval from the 'lval' line
+alloc() {
+  "$LISPY" "$1" | awk '/^lval :/ {
+    for (i = 1; i <= NF; i++) {
+      if ($(i + 1) ~ /^live/)    { live = $i }
+      if ($(i + 1) == "slabs")   { slabs = $i; size = $(i + 3) }
+      if ($(i + 1) == "bytes" && $(i + 2) == "per") { obj = $i }
+    }
+    print live, slabs, size, obj
+  }'
+}
+
+set -- $(alloc "$DIR/empty.lspy") $(alloc "$DIR/big.lspy")
+awk -v n="$N" -v l0="$1" -v s0="$2" -v l1="$5" -v s1="$6" -v slab="$7" -v obj="$8" 'BEGIN {
+  printf "%d elements : %d more lvals live, %d more slabs (%.1f MB)\n",
+    n, l1 - l0, s1 - s0, (s1 - s0) * slab / 1048576
+  printf "%d bytes per lval, %.1f bytes of slab per element, plus %.1f of cell pointers\n",
+    obj, (s1 - s0) * slab / n, 8 * (l1 - l0) / n
+}'
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Vectors against Q-expressions doing the same work, in ns per element.
+# Sums a million numbers by head/tail recursion over a list and with
+# 'vsum', and adds two lists element by element by joining onto a result
+# and with 'v+'. The list addition only gets 10000 elements, since each
+# join copies what was built so far. Building the inputs is timed on its
+# own and taken off.
+#
+# usage : sh bench/vec.sh [lispy]
+
+LISPY=${1:-./lispy}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+ms() {
+  start=$(date +%s%N)
+  "$LISPY" "$@" > "$DIR/out"
+  end=$(date +%s%N)
+  grep '^Error' "$DIR/out" >&2
+  echo $(( (end - start) / 1000000 ))
+}
+
+# prints ns per element of running file after the inputs, n elements
+# each time, reps times
+per() {
+  printf '(def {v} (vrange %d))\n(def {q} (vlist v))\n' "$2" > "$DIR/base.lspy"
+  base=$(ms "$DIR/base.lspy")
+  t=$(ms "$DIR/base.lspy" "$DIR/$1.lspy")
+  awk -v t="$t" -v base="$base" -v n="$2" -v reps="$3" \
+    'BEGIN { printf "%10.1f", (t - base) * 1e6 / (n * reps) }'
+}
+
+cat > "$DIR/qsum.lspy" <<'LSPY'
+(def {qsum} (\ {xs acc} {if (== xs {}) {acc} {qsum (tail xs) (+ acc (eval (head xs)))}}))
+(print (qsum q 0))
+LSPY
+cat > "$DIR/vsum.lspy" <<'LSPY'
+(def {go} (\ {n acc} {if (== n 0) {acc} {go (- n 1) (+ acc (vsum v))}}))
+(print (go 100 0))
+LSPY
+cat > "$DIR/qadd.lspy" <<'LSPY'
+(def {qadd} (\ {xs ys acc} {if (== xs {}) {acc}
+  {qadd (tail xs) (tail ys) (join acc (list (+ (eval (head xs)) (eval (head ys)))))}}))
+(print (head (qadd q q {})))
+LSPY
+cat > "$DIR/vadd.lspy" <<'LSPY'
+(def {go} (\ {n acc} {if (== n 0) {acc} {go (- n 1) (+ acc (vlen (v+ v v)))}}))
+(print (go 100 0))
+LSPY
+
+echo "                 Q-expression      vector  (ns per element)"
+echo "sum          $(per qsum 1000000 1)  $(per vsum 1000000 100)"
+echo "add          $(per qadd 10000 1)  $(per vadd 1000000 100)"
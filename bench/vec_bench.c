@@ -0,0 +1,236 @@
+#include "lispy.h"
+#include <math.h>
+#include <time.h>
+
+/* Vector kernels, see lvec.c.
+
+   'vec_bench check' runs every kernel over random vectors at each level
+   of instructions, and checks the SSE2 and AVX2 ones give the same bits
+   as the plain C loops, errors included. Only a NaN may come out as
+   another NaN, see lvec.c. The lengths cover every remainder past the
+   last full vector, numbers are broadcast as well as read from a vector,
+   and the doubles include NaN, infinities, zeros of either sign and
+   denormals. 'make test' runs it built with the sanitizers.
+
+   'vec_bench' times some of the kernels in ns per element at each level,
+   over vectors that stay in the cache. */
+
+enum { LEVELS = 3, MAX_N = 259 };
+
+static unsigned long long rnd_state = 88172645463325252ull;
+
+/* Where timed results go, so they aren't left out */
+static volatile double sink;
+
+/* xorshift, so every run does the same operations */
+static unsigned long long rnd(void)
+{
+  rnd_state ^= rnd_state << 13;
+  rnd_state ^= rnd_state >> 7;
+  rnd_state ^= rnd_state << 17;
+  return rnd_state;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Mostly small integers, so that some sums and products overflow and
+   most don't, with zeros to divide by and the extremes */
+static int64_t rnd_int(void)
+{
+  switch (rnd() % 16) {
+    case 0:  return 0;
+    case 1:  return INT64_MIN;
+    case 2:  return INT64_MAX;
+    case 3:  return -1;
+    case 4:  return (int64_t)rnd();
+    case 5:  return (int64_t)(rnd() >> 32) - (1ll << 31);
+  }
+  return (int64_t)(rnd() % 201) - 100;
+}
+
+static double rnd_dbl(void)
+{
+  switch (rnd() % 24) {
+    case 0:  return NAN;
+    case 1:  return -NAN;
+    case 2:  return INFINITY;
+    case 3:  return -INFINITY;
+    case 4:  return 0.0;
+    case 5:  return -0.0;
+    case 6:  return 4.9e-324;
+    case 7:  return 1.7e308;
+    case 8:  return -1.7e308;
+  }
+  return ((double)(rnd() % 2000001) - 1000000.0) / (double)(rnd() % 1000 + 1);
+}
+
+/* What a kernel gave at one level */
+typedef struct result
+{
+  char*   msg;
+  int64_t ints[MAX_N];
+  double  dbls[MAX_N];
+  int64_t i;
+  double  d;
+} result;
+
+static int same_dbl(double a, double b)
+{
+  return memcmp(&a, &b, sizeof(double)) == 0 || (a != a && b != b);
+}
+
+static int same(result* a, result* b, int n)
+{
+  if (a->msg != b->msg) { return 0; }
+
+  /* An error leaves the result array unspecified */
+  if (a->msg) { return 1; }
+  for (int i = 0; i < n; i++) {
+    if (a->ints[i] != b->ints[i] || !same_dbl(a->dbls[i], b->dbls[i])) {
+      return 0;
+    }
+  }
+  return a->i == b->i && same_dbl(a->d, b->d);
+}
+
+static char* kernel_names[] = {
+  "arith int", "arith double", "compare int", "compare double", "sum int",
+  "sum double", "dot int", "dot double", "min/max int", "min/max double",
+  "scan int", "scan double"
+};
+
+enum { KERNELS = sizeof(kernel_names) / sizeof(kernel_names[0]) };
+
+static void run(int k, int op, result* r, int64_t* xi, int xs, int64_t* yi,
+  int ys, double* xd, double* yd, int n)
+{
+  memset(r, 0, sizeof(result));
+  switch (k) {
+    case 0:  r->msg = lvec_arith_int(op % 4, r->ints, xi, xs, yi, ys, n); break;
+    case 1:  lvec_arith_dbl(op % 4, r->dbls, xd, xs, yd, ys, n); break;
+    case 2:  lvec_compare_int(op % 5, r->ints, xi, xs, yi, ys, n); break;
+    case 3:  lvec_compare_dbl(op % 5, r->ints, xd, xs, yd, ys, n); break;
+    case 4:  r->msg = lvec_sum_int(xi, n, &r->i); break;
+    case 5:  r->d = lvec_sum_dbl(xd, n); break;
+    case 6:  r->msg = lvec_dot_int(xi, yi, n, &r->i); break;
+    case 7:  r->d = lvec_dot_dbl(xd, yd, n); break;
+    case 8:  if (n) { r->i = lvec_extreme_int(op % 2, xi, n); } break;
+    case 9:  if (n) { r->d = lvec_extreme_dbl(op % 2, xd, n); } break;
+    case 10: r->msg = lvec_scan_int(r->ints, xi, n); break;
+    case 11: lvec_scan_dbl(r->dbls, xd, n); break;
+  }
+}
+
+static int check(void)
+{
+  enum { ROUNDS = 20000 };
+  int64_t xi[MAX_N], yi[MAX_N];
+  double  xd[MAX_N], yd[MAX_N];
+  result* r = malloc(sizeof(result) * LEVELS);
+
+  for (int round = 0; round < ROUNDS; round++) {
+    int n = rnd() % 2 ? rnd() % 20 : rnd() % MAX_N;
+    for (int i = 0; i < n; i++) {
+      xi[i] = rnd_int();
+      yi[i] = rnd_int();
+      xd[i] = rnd_dbl();
+      yd[i] = rnd_dbl();
+    }
+
+    /* Element-wise kernels also take a Number for either operand */
+    int xs = n == 0 || rnd() % 4 ? 1 : 0;
+    int ys = n == 0 || rnd() % 4 ? 1 : 0;
+    if (n == 0) { xi[0] = yi[0] = 0; xd[0] = yd[0] = 0.0; }
+
+    for (int k = 0; k < KERNELS; k++) {
+      int op  = rnd() % 20;
+      int vxs = k < 4 ? xs : 1;
+      int vys = k < 4 ? ys : 1;
+      for (int level = 0; level < LEVELS; level++) {
+        lvec_set("level", level);
+        run(k, op, &r[level], xi, vxs, yi, vys, xd, yd, n);
+      }
+      for (int level = 1; level < LEVELS; level++) {
+        if (!same(&r[0], &r[level], n)) {
+          fprintf(stderr, "vec : %s, op %d, %d elements, differs at level %d "
+            "in round %d\n", kernel_names[k], op, n, level, round);
+          free(r);
+          return 1;
+        }
+      }
+    }
+  }
+
+  free(r);
+  printf("vec : %d rounds of every kernel agree at every level\n", ROUNDS);
+  return 0;
+}
+
+static void bench(void)
+{
+  enum { N = 4096, REPS = 20000 };
+  int64_t* xi = malloc(sizeof(int64_t) * N);
+  int64_t* ri = malloc(sizeof(int64_t) * N);
+  double*  xd = malloc(sizeof(double) * N);
+  double*  yd = malloc(sizeof(double) * N);
+  double*  rd = malloc(sizeof(double) * N);
+  for (int i = 0; i < N; i++) {
+    xi[i] = i;
+    xd[i] = i * 0.5;
+    yd[i] = N - i * 0.25;
+  }
+
+  printf("vec : ns per element over %d elements\n", N);
+  printf("vec :         add.i  mul.d  sum.i  sum.d  dot.d  max.i   lt.d\n");
+  for (int level = 0; level < LEVELS; level++) {
+    lvec_set("level", level);
+    double  t[7];
+    int64_t s;
+    double  acc = 0;
+
+    for (int k = 0; k < 7; k++) {
+      double start = now();
+      for (int r = 0; r < REPS; r++) {
+        switch (k) {
+          case 0: lvec_arith_int(LVEC_ADD, ri, xi, 1, xi, 1, N); break;
+          case 1: lvec_arith_dbl(LVEC_MUL, rd, xd, 1, yd, 1, N); break;
+          case 2: lvec_sum_int(xi, N, &s); acc += s; break;
+          case 3: acc += lvec_sum_dbl(xd, N); break;
+          case 4: acc += lvec_dot_dbl(xd, yd, N); break;
+          case 5: acc += lvec_extreme_int(1, xi, N); break;
+          case 6: lvec_compare_dbl(LVEC_LT, ri, xd, 1, yd, 1, N); break;
+        }
+      }
+      t[k] = (now() - start) * 1000000.0 / ((double)N * REPS);
+    }
+    sink = acc + ri[N - 1] + rd[N - 1];
+
+    /* The level asked for may be more than the CPU has */
+    char* names[] = { "plain", "sse2", "avx2" };
+    printf("vec : %-6s %6.2f %6.2f %6.2f %6.2f %6.2f %6.2f %6.2f\n",
+      names[level], t[0], t[1], t[2], t[3], t[4], t[5], t[6]);
+  }
+  lvec_print();
+
+  free(xi);
+  free(ri);
+  free(xd);
+  free(yd);
+  free(rd);
+}
+
+int main(int argc, char** argv)
+{
+  int failed = 0;
+  if (argc > 1 && strcmp(argv[1], "check") == 0) {
+    failed = check();
+  } else {
+    bench();
+  }
+  return failed;
+}
@@ -10,9 +10,9 @@ lval* builtin_lambda(lenv* e, lval* a)
     /* Check first Q-Expression contains only Symbols */
   for (int i = 0; i < a->cell[0]->count; i++) 
   {
-    LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+    LASSERT(a, (LVAL_TYPE(a->cell[0]->cell[i]) == LVAL_SYM),
       "Cannot define non-symbol. Got %s, Expected %s.",
-      ltype_name(a->cell[0]->cell[i]->type),ltype_name(LVAL_SYM));
+      ltype_name(LVAL_TYPE(a->cell[0]->cell[i])),ltype_name(LVAL_SYM));
   }
   
   /* Pop first two elements and create a lambda value from it */
@@ -20,11 +20,14 @@ lval* builtin_lambda(lenv* e, lval* a)
   lval* body    = lval_pop(a, 0);
   lval_del(a);
   
-  return lval_lambda(formals, body);
+  /* The lambda closes over the environment it is made in */
+  lval* code = lvm_compile(body, formals);
+  return lval_lambda(lval_ref(e->self), formals, code);
 }
 
 lval* builtin_list(lenv* e, lval* a)
 {
+  a = lval_unshare(a);
   a->type = LVAL_QEXPR;
   return a;
 }
@@ -35,9 +38,7 @@ lval* builtin_head(lenv* e, lval* a)
   LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
   LASSERT_NOT_EMPTY("head", a, 0);
   
-  lval* v = lval_take(a, 0);
-  while (v->count > 1) { lval_del(lval_pop(v, 1)); }
-  return v;
+  return lval_slice(lval_take(a, 0), 0, 1);
 }
 
 lval* builtin_tail(lenv* e, lval* a)
@@ -47,21 +48,24 @@ lval* builtin_tail(lenv* e, lval* a)
   LASSERT_NOT_EMPTY("tail", a, 0);
   
   lval* v = lval_take(a, 0);
-  lval_del(lval_pop(v, 0));
-  lval_del(a);
-  return v;
+  return lval_slice(v, 1, v->count - 1);
 }
 
-lval* builtin_eval(lenv* e, lval* a)
+/* The expression 'eval' evaluates, or an error. Split out of
+   builtin_eval so that the evaluator can carry on with it, see lvm_apply */
+lval* builtin_eval_expr(lval* a)
 {
   LASSERT_NUM("eval", a, 1);
   LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
   
-  lval* x = lval_take(a, 0);
+  lval* x = lval_unshare(lval_take(a, 0));
   x->type = LVAL_SEXPR;
-  lval_del(a);
-  
-  return lval_eval(e, x);
+  return x;
+}
+
+lval* builtin_eval(lenv* e, lval* a)
+{
+  return lval_eval(e, builtin_eval_expr(a));
 }
 
 lval* builtin_join(lenv* e, lval* a)
@@ -73,53 +77,162 @@ lval* builtin_join(lenv* e, lval* a)
   
   lval* x = lval_pop(a, 0);
   
-  for(int i = 0;i < a->count; i++)
+  while (a->count)
   {
     lval* y = lval_pop(a, 0);
-    lval_join(x, y);
+    x = lval_join(x, y);
   }
   
   lval_del(a);
   return x;
 }
 
-lval* builtin_op(lenv* e, lval* a, char* op)
-{
-  for(int i = 0; i < a->count; i++)
-  {
-    LASSERT_TYPE(op, a, i, LVAL_NUM);
-  }
-  
-  lval* x = lval_pop(a, 0);
-  
-  if(strcmp(op, "-") == 0 && a->count == 1) 
-  {
-    x->num = -x->num; 
+/* Arithmetic kernels. Each operator gets a builtin of its own, stamped
+   out by LBUILTIN_ARITH, which folds step over the argument cells in
+   place. step updates the running result r with the next operand n, or
+   sets err if the result would be undefined. Two fixnums, by far the
+   most common case, skip the type checks and the loop, and so do two
+   immediates of which one is a flonum. unary is applied to r when
+   there is a single argument.
+   
+   Once a Double turns up the rest is worked out in doubles, with dstep
+   and dunary on dr and dn. Those follow IEEE 754, so dividing by zero
+   gives an infinity rather than an error. */
+#define LBUILTIN_ARITH(name, op, step, unary, dstep, dunary)          \
+  lval* builtin_##name(lenv* e, lval* a)                              \
+  {                                                                   \
+    char*  err = NULL;                                                \
+    long   r, n;                                                      \
+    double dr, dn;                                                    \
+    int    dbl = 0;                                                   \
+                                                                      \
+    if (a->count == 2 && LVAL_IS_FIXNUM(a->cell[0]) &&                \
+      LVAL_IS_FIXNUM(a->cell[1]))                                     \
+    {                                                                 \
+      r = LVAL_FIXNUM_VAL(a->cell[0]);                                \
+      n = LVAL_FIXNUM_VAL(a->cell[1]);                                \
+      step;                                                           \
+    }                                                                 \
+    else if (a->count == 2 && LVAL_IS_IMMEDIATE(a->cell[0]) &&        \
+      LVAL_IS_IMMEDIATE(a->cell[1]))                                  \
+    {                                                                 \
+      dbl = 1;                                                        \
+      dr  = LVAL_AS_DBL(a->cell[0]);                                  \
+      dn  = LVAL_AS_DBL(a->cell[1]);                                  \
+      dstep;                                                          \
+    }                                                                 \
+    else                                                              \
+    {                                                                 \
+      LASSERT(a, a->count > 0,                                        \
+        "Function '%s' passed no arguments.", op);                    \
+      for (int i = 0; i < a->count; i++) {                            \
+        LASSERT_NUMERIC(op, a, i);                                    \
+      }                                                               \
+                                                                      \
+      dbl = LVAL_TYPE(a->cell[0]) == LVAL_DBL;                        \
+      if (dbl) { dr = LVAL_DBL_VAL(a->cell[0]); }                     \
+      else     { r  = LVAL_NUM_VAL(a->cell[0]); }                     \
+      if (a->count == 1) {                                            \
+        if (dbl) { dunary; } else { unary; }                          \
+      }                                                               \
+      for (int i = 1; i < a->count && !err; i++) {                    \
+        lval* x = a->cell[i];                                         \
+        if (!dbl && LVAL_TYPE(x) == LVAL_DBL) {                       \
+          dbl = 1;                                                    \
+          dr  = r;                                                    \
+        }                                                             \
+        if (dbl) { dn = LVAL_AS_DBL(x); dstep; }                      \
+        else     { n  = LVAL_NUM_VAL(x); step; }                      \
+      }                                                               \
+    }                                                                 \
+                                                                      \
+    lval_del(a);                                                      \
+    if (err) { return lval_err(err); }                                \
+    return dbl ? lval_dbl(dr) : lval_num(r);                          \
   }
+
+LBUILTIN_ARITH(add, "+",
+  if (__builtin_add_overflow(r, n, &r)) { err = LOP_OVERFLOW; }, (void)0,
+  dr += dn, (void)0)
+LBUILTIN_ARITH(sub, "-",
+  if (__builtin_sub_overflow(r, n, &r)) { err = LOP_OVERFLOW; },
+  if (r == LONG_MIN) { err = LOP_OVERFLOW; } else { r = -r; },
+  dr -= dn, dr = -dr)
+LBUILTIN_ARITH(mul, "*",
+  if (__builtin_mul_overflow(r, n, &r)) { err = LOP_OVERFLOW; }, (void)0,
+  dr *= dn, (void)0)
+LBUILTIN_ARITH(div, "/",
+  if (n == 0) { err = LOP_DIV_ZERO; }
+  else if (n == -1 && r == LONG_MIN) { err = LOP_OVERFLOW; }
+  else { r /= n; }, (void)0,
+  dr /= dn, (void)0)
+LBUILTIN_ARITH(mod, "%",
+  if (n == 0) { err = LOP_DIV_ZERO; }
+  else if (n == -1) { r = 0; }
+  else { r %= n; }, (void)0,
+  dr = fmod(dr, dn), (void)0)
+
+/* Orders a Number against a Double without going through a double
+   that might round the Number. Gives -1, 0 or 1, or LCMP_UNORDERED when
+   d is NaN. Whatever d is, it is a whole number past the fractional
+   part, which takes off exactly */
+enum { LCMP_UNORDERED = 2 };
+
+static int lnum_cmp_dbl(long n, double d)
+{
+  if (d != d)                 { return LCMP_UNORDERED; }
+  if (d >= -(double)LONG_MIN) { return -1; }
+  if (d < (double)LONG_MIN)   { return 1; }
   
-  while(a->count > 0)
-  {
-    lval *y = lval_pop(a, 0);
-    if (strcmp(op, "+") == 0) { x->num += y->num; }
-    if (strcmp(op, "-") == 0) { x->num -= y->num; }
-    if (strcmp(op, "*") == 0) { x->num *= y->num; }
-    if (strcmp(op, "%") == 0) { x->num %= y->num; }
-    if (strcmp(op, "/") == 0) {
-      if (y->num == 0) {
-        lval_del(x); lval_del(y);
-        x = lval_err("Division By Zero.");
-        break;
-      }
-      x->num /= y->num;
-    }
-    
-    lval_del(y);
+  long   t = (long)d;
+  double f = d - (double)t;
+  if (n != t) { return n < t ? -1 : 1; }
+  return f > 0 ? -1 : f < 0;
+}
+
+/* The same with a Number and a Double either way round */
+static int lval_cmp_mixed(lval* x, lval* y)
+{
+  if (LVAL_TYPE(x) == LVAL_DBL) {
+    int c = lval_cmp_mixed(y, x);
+    return c == LCMP_UNORDERED ? c : -c;
   }
-  
-  lval_del(a);
-  return x;
+  return lnum_cmp_dbl(LVAL_NUM_VAL(x), LVAL_DBL_VAL(y));
 }
 
+/* Ordering kernels, the same way. A Number compared with a Double is
+   ordered exactly, as == compares them */
+#define LBUILTIN_ORD(name, op, cmp)                                   \
+  lval* builtin_##name(lenv* e, lval* a)                              \
+  {                                                                   \
+    if (!(a->count == 2 && LVAL_IS_FIXNUM(a->cell[0]) &&              \
+      LVAL_IS_FIXNUM(a->cell[1])))                                    \
+    {                                                                 \
+      LASSERT_NUM(op, a, 2);                                          \
+      LASSERT_NUMERIC(op, a, 0);                                      \
+      LASSERT_NUMERIC(op, a, 1);                                      \
+    }                                                                 \
+                                                                      \
+    lval* x = a->cell[0];                                             \
+    lval* y = a->cell[1];                                             \
+    int   r;                                                          \
+    if (LVAL_TYPE(x) != LVAL_TYPE(y)) {                               \
+      int c = lval_cmp_mixed(x, y);                                   \
+      r = c != LCMP_UNORDERED && c cmp 0;                             \
+    } else {                                                          \
+      r = LVAL_TYPE(x) == LVAL_NUM                                    \
+        ? LVAL_NUM_VAL(x) cmp LVAL_NUM_VAL(y)                         \
+        : LVAL_DBL_VAL(x) cmp LVAL_DBL_VAL(y);                        \
+    }                                                                 \
+    lval_del(a);                                                      \
+    return lval_num(r);                                               \
+  }
+
+LBUILTIN_ORD(gt, ">",  >)
+LBUILTIN_ORD(lt, "<",  <)
+LBUILTIN_ORD(ge, ">=", >=)
+LBUILTIN_ORD(le, "<=", <=)
+
 lval* builtin_var(lenv* e, lval* a, char* func)
 {
   LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
@@ -127,10 +240,10 @@ lval* builtin_var(lenv* e, lval* a, char* func)
   /* Get the first expression and check that it does not contain symbols */
   lval* syms = a->cell[0];
   for (int i = 0; i < syms->count; i++) {
-    LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+    LASSERT(a, (LVAL_TYPE(syms->cell[i]) == LVAL_SYM),
       "Function '%s' cannot define non-symbol. "
       "Got %s, Expected %s.", func, 
-      ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+      ltype_name(LVAL_TYPE(syms->cell[i])), ltype_name(LVAL_SYM));
   }
   
   /* Check that the values passed are exactly equal in number to the variable names */
@@ -149,100 +262,731 @@ lval* builtin_var(lenv* e, lval* a, char* func)
     } 
   }
   
+  /* Bindings changed, so cached lookups can't be trusted any more */
+  lenv_version++;
+  
   lval_del(a);
   return lval_sexpr();
 }
 
-lval* builtin_ord(lenv* e, lval* a, char* op)
+/* The stack starts out in local, on the C stack of lval_eq, and only
+   moves to the heap for deeply nested values. Looking keys up in a map
+   compares them, and shouldn't have to allocate */
+static void lval_eq_push(lval*** s, int* n, int* cap, lval** local,
+  lval* x, lval* y)
 {
-  LASSERT_NUM(op, a, 2);
-  LASSERT_TYPE(op, a, 0, LVAL_NUM);
-  LASSERT_TYPE(op, a, 1, LVAL_NUM);
-  
-  int r;
-  if (strcmp(op, ">")  == 0) {
-    r = (a->cell[0]->num >  a->cell[1]->num);
-  }
-  if (strcmp(op, "<")  == 0) {
-    r = (a->cell[0]->num <  a->cell[1]->num);
-  }
-  if (strcmp(op, ">=") == 0) {
-    r = (a->cell[0]->num >= a->cell[1]->num);
-  }
-  if (strcmp(op, "<=") == 0) {
-    r = (a->cell[0]->num <= a->cell[1]->num);
+  if (*n + 2 > *cap)
+  {
+    lval** t = malloc(sizeof(lval*) * *cap * 2);
+    memcpy(t, *s, sizeof(lval*) * *n);
+    if (*s != local) { free(*s); }
+    *s    = t;
+    *cap *= 2;
   }
-  lval_del(a);
-  return lval_num(r);
+  (*s)[(*n)++] = x;
+  (*s)[(*n)++] = y;
+}
+
+/* Whether a Number and a Double hold the same number, see
+   lnum_cmp_dbl */
+static int lval_eq_mixed(lval* x, lval* y)
+{
+  if (LVAL_TYPE(x) == LVAL_DBL) { lval* t = x; x = y; y = t; }
+  if (LVAL_TYPE(x) != LVAL_NUM || LVAL_TYPE(y) != LVAL_DBL) { return 0; }
+  return lval_cmp_mixed(x, y) == 0;
 }
 
+/* Compares pairs from a stack of its own rather than recursing, so
+   values nest as deep as memory allows */
 int lval_eq(lval* x, lval* y)
 {
-  if(x->type != y->type) return 0;
+  lval*  local[32];
+  lval** s   = local;
+  int    n   = 0;
+  int    cap = 32;
+  int    eq  = 1;
   
-  switch(x->type)
+  for (;;)
   {
-    case LVAL_NUM   : 
-      return x->num == y->num;
-    case LVAL_ERR   :
-      return strcmp(x->err, y->err) == 0;
-    case LVAL_SYM   :
-      return strcmp(x->err, y->err) == 0;
-    case LVAL_STR: 
-      return (strcmp(x->str, y->str) == 0);
-    case LVAL_FUN   :
-      if(x->builtin || y->builtin) return x->builtin == y->builtin;
+    /* Shared values are equal without looking inside, other than a
+       double, which is not equal to itself when it is NaN */
+    if (x != y || LVAL_TYPE(x) == LVAL_DBL) {
+      if (LVAL_TYPE(x) != LVAL_TYPE(y)) { eq = lval_eq_mixed(x, y); }
       
-      return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
-    case LVAL_QEXPR :
-    case LVAL_SEXPR :
-      if (x->count != y->count) { return 0; }
-      for(int i = 0; i < x->count; i++)
+      else switch(LVAL_TYPE(x))
       {
-         if (!lval_eq(x->cell[i], y->cell[i])) { return 0; }
+        case LVAL_NUM   : 
+          eq = LVAL_NUM_VAL(x) == LVAL_NUM_VAL(y);
+          break;
+        case LVAL_DBL   :
+          eq = LVAL_DBL_VAL(x) == LVAL_DBL_VAL(y);
+          break;
+        case LVAL_ERR   :
+          eq = strcmp(x->err, y->err) == 0;
+          break;
+        case LVAL_SYM   :
+          eq = x->sym == y->sym;
+          break;
+        case LVAL_STR: 
+          eq = strcmp(x->str, y->str) == 0;
+          break;
+        case LVAL_FUN   :
+          if(LVAL_IS_BUILTIN(x) || LVAL_IS_BUILTIN(y)) {
+            eq = LVAL_IS_BUILTIN(x) && LVAL_IS_BUILTIN(y) && x->builtin == y->builtin;
+            break;
+          }
+          lval_eq_push(&s, &n, &cap, local, x->body, y->body);
+          lval_eq_push(&s, &n, &cap, local, x->formals, y->formals);
+          break;
+        case LVAL_CODE  :
+          lval_eq_push(&s, &n, &cap, local, x->src, y->src);
+          break;
+        case LVAL_MAP   :
+          /* Every key of x has to be in y, with an equal value */
+          if (lmap_count(x->map) != lmap_count(y->map)) { eq = 0; break; }
+          for (int i = lmap_next(x->map, 0); i >= 0; i = lmap_next(x->map, i + 1))
+          {
+            lval* v = lmap_get(y->map, lmap_key(x->map, i));
+            if (!v) { eq = 0; break; }
+            lval_eq_push(&s, &n, &cap, local, lmap_val(x->map, i), v);
+          }
+          break;
+        case LVAL_PMAP  : {
+          if (x->nkeys != y->nkeys) { eq = 0; break; }
+          if (x->root == y->root)   { break; }
+          lval** kv = lhamt_entries(x->root, x->nkeys);
+          for (int i = 0; i < x->nkeys; i++)
+          {
+            lval* v = lhamt_get(y->root, kv[2*i]);
+            if (!v) { eq = 0; break; }
+            lval_eq_push(&s, &n, &cap, local, kv[2*i+1], v);
+          }
+          free(kv);
+          break;
+        }
+        case LVAL_VEC   :
+          /* Compared by value, so #i[1 2] == #f[1 2] as 1 == 1.0 */
+          if (x->len != y->len) { eq = 0; break; }
+          if (x->elem == LVEC_DBL) { lval* t = x; x = y; y = t; }
+          for (int i = 0; i < x->len && eq; i++)
+          {
+            if (x->elem == LVEC_DBL) {
+              eq = x->dbls[i] == y->dbls[i];
+            } else if (y->elem == LVEC_DBL) {
+              eq = lnum_cmp_dbl(x->ints[i], y->dbls[i]) == 0;
+            } else {
+              eq = x->ints[i] == y->ints[i];
+            }
+          }
+          break;
+        case LVAL_QEXPR :
+        case LVAL_SEXPR :
+          if (x->count != y->count) { eq = 0; break; }
+          
+          /* Hashed before, and not changed since, see lval_hash */
+          if ((x->flags & y->flags & LVAL_HASHED) && x->hash != y->hash) {
+            eq = 0;
+            break;
+          }
+          
+          /* Equal numbers are the same tagged word */
+          if (LVAL_IS_PACKED(x) && LVAL_IS_PACKED(y)) {
+            eq = !x->count
+              || memcmp(x->cell, y->cell, sizeof(lval*) * x->count) == 0;
+            break;
+          }
+          for(int i = x->count - 1; i >= 0; i--)
+          {
+            lval_eq_push(&s, &n, &cap, local, x->cell[i], y->cell[i]);
+          }
+          break;
+        default:
+          eq = 0;
+          break;
       }
-      return 1;
+    }
+    
+    if (!eq || n == 0) { break; }
+    y = s[--n];
+    x = s[--n];
   }
   
-  return 0;
+  if (s != local) { free(s); }
+  return eq;
 }
 
-lval* builtin_cmp(lenv* e, lval* a, char* op)
+lval* builtin_eq(lenv* e, lval* a)
 {
-  LASSERT_NUM(op, a, 2);
-  int r = 0;
-  if(strcmp(op, "==") == 0)
-    r = lval_eq(a->cell[0], a->cell[1]);
-  else if (strcmp(op, "!=") == 0)
-    r = !lval_eq(a->cell[0], a->cell[1]);
-    
+  LASSERT_NUM("==", a, 2);
+  int r = lval_eq(a->cell[0], a->cell[1]);
   lval_del(a);
   return lval_num(r);
 }
 
-lval* builtin_if(lenv* e, lval* a)
+lval* builtin_ne(lenv* e, lval* a)
+{
+  LASSERT_NUM("!=", a, 2);
+  int r = !lval_eq(a->cell[0], a->cell[1]);
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval* builtin_hash(lenv* e, lval* a)
+{
+  LASSERT_NUM("hash", a, 1);
+  uint32_t h = lval_hash(a->cell[0]);
+  lval_del(a);
+  return lval_num(h);
+}
+
+/* Maps. 'insert' and 'delete' give back the map changed, which is done
+   in place unless the map is shared, see lval_unshare */
+
+/* Put the key and value pairs of a from index i on into the map m */
+static lval* builtin_map_put(lval* m, lval* a, int i)
+{
+  for (; i < a->count; i += 2) {
+    lmap_put(m->map, lval_ref(a->cell[i]), lval_ref(a->cell[i+1]));
+  }
+  lval_del(a);
+  return m;
+}
+
+/* 'map {k v k v}' makes a map of the pairs in the list */
+lval* builtin_map(lenv* e, lval* a)
+{
+  LASSERT_NUM("map", a, 1);
+  LASSERT_TYPE("map", a, 0, LVAL_QEXPR);
+  LASSERT(a, (a->cell[0]->count % 2 == 0),
+    "Function 'map' passed %i items. Expected key and value pairs.",
+    a->cell[0]->count);
+  
+  lval* m = lval_map();
+  return builtin_map_put(m, lval_take(a, 0), 0);
+}
+
+lval* builtin_insert(lenv* e, lval* a)
+{
+  LASSERT(a, (a->count % 2 == 1),
+    "Function 'insert' passed %i arguments. "
+    "Expected a map followed by key and value pairs.", a->count);
+  LASSERT_TYPE("insert", a, 0, LVAL_MAP);
+  
+  lval* m = lval_unshare(lval_pop(a, 0));
+  return builtin_map_put(m, a, 0);
+}
+
+/* 'lookup', 'size', 'keys' and 'pairs' take either kind of map */
+#define LASSERT_MAP(func, args, index) \
+  LASSERT(args, LVAL_TYPE(args->cell[index]) == LVAL_MAP \
+    || LVAL_TYPE(args->cell[index]) == LVAL_PMAP, \
+    "Function '%s' passed incorrect type for argument %i. " \
+    "Got %s, Expected %s or %s.", \
+    func, index, ltype_name(LVAL_TYPE(args->cell[index])), \
+    ltype_name(LVAL_MAP), ltype_name(LVAL_PMAP))
+
+lval* builtin_lookup(lenv* e, lval* a)
+{
+  LASSERT(a, (a->count == 2 || a->count == 3),
+    "Function 'lookup' passed incorrect number of arguments. "
+    "Got %i, Expected 2 or 3.", a->count);
+  LASSERT_MAP("lookup", a, 0);
+  
+  /* A third argument is the value when the key isn't there */
+  lval* m = a->cell[0];
+  lval* v = m->type == LVAL_MAP ? lmap_get(m->map, a->cell[1])
+    : lhamt_get(m->root, a->cell[1]);
+  if (!v && a->count == 3) { v = a->cell[2]; }
+  LASSERT(a, v, "Function '%s' passed a key not in the map.", "lookup");
+  
+  v = lval_ref(v);
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_delete(lenv* e, lval* a)
+{
+  LASSERT(a, (a->count > 0), "Function '%s' passed no arguments.", "delete");
+  LASSERT_TYPE("delete", a, 0, LVAL_MAP);
+  
+  lval* m = lval_unshare(lval_pop(a, 0));
+  for (int i = 0; i < a->count; i++) { lmap_remove(m->map, a->cell[i]); }
+  lval_del(a);
+  return m;
+}
+
+lval* builtin_size(lenv* e, lval* a)
+{
+  LASSERT_NUM("size", a, 1);
+  LASSERT_MAP("size", a, 0);
+  
+  lval* m = a->cell[0];
+  lval* r = lval_num(m->type == LVAL_MAP ? lmap_count(m->map) : m->nkeys);
+  lval_del(a);
+  return r;
+}
+
+/* The keys of a map, or its entries as {key value} lists, in the order
+   the map prints them */
+static lval* builtin_entry(lval* q, lval* k, lval* v, int pairs)
+{
+  lval* x = lval_ref(k);
+  if (pairs) { x = lval_add(lval_add(lval_qexpr(), x), lval_ref(v)); }
+  return lval_add(q, x);
+}
+
+static lval* builtin_entries(lval* a, char* func, int pairs)
+{
+  LASSERT_NUM(func, a, 1);
+  LASSERT_MAP(func, a, 0);
+  
+  lval* q = lval_qexpr();
+  if (a->cell[0]->type == LVAL_PMAP) {
+    lval*  p  = a->cell[0];
+    lval** kv = lhamt_entries(p->root, p->nkeys);
+    for (int i = 0; i < p->nkeys; i++) {
+      q = builtin_entry(q, kv[2*i], kv[2*i+1], pairs);
+    }
+    free(kv);
+  } else {
+    lmap* m = a->cell[0]->map;
+    for (int i = lmap_next(m, 0); i >= 0; i = lmap_next(m, i + 1)) {
+      q = builtin_entry(q, lmap_key(m, i), lmap_val(m, i), pairs);
+    }
+  }
+  lval_del(a);
+  return q;
+}
+
+lval* builtin_keys(lenv* e, lval* a)  { return builtin_entries(a, "keys", 0); }
+lval* builtin_pairs(lenv* e, lval* a) { return builtin_entries(a, "pairs", 1); }
+
+/* Persistent maps. 'assoc' and 'dissoc' give back a new map sharing
+   all it can with the one they were passed, which stays as it was, see
+   lhamt.c */
+
+/* A persistent map of p with the key and value pairs of a from index i
+   on added */
+static lval* builtin_pmap_put(lval* p, lval* a, int i)
+{
+  lval* root  = p ? p->root : NULL;
+  int   nkeys = p ? p->nkeys : 0;
+  if (root) { lval_ref(root); }
+  
+  for (; i < a->count; i += 2) {
+    int   added;
+    lval* x = lhamt_assoc(root, a->cell[i], a->cell[i+1], &added);
+    if (root) { lval_del(root); }
+    root   = x;
+    nkeys += added;
+  }
+  lval_del(a);
+  return lval_pmap(root, nkeys);
+}
+
+/* 'pmap {k v k v}' makes a persistent map of the pairs in the list */
+lval* builtin_pmap(lenv* e, lval* a)
+{
+  LASSERT_NUM("pmap", a, 1);
+  LASSERT_TYPE("pmap", a, 0, LVAL_QEXPR);
+  LASSERT(a, (a->cell[0]->count % 2 == 0),
+    "Function 'pmap' passed %i items. Expected key and value pairs.",
+    a->cell[0]->count);
+  
+  return builtin_pmap_put(NULL, lval_take(a, 0), 0);
+}
+
+lval* builtin_assoc(lenv* e, lval* a)
+{
+  LASSERT(a, (a->count % 2 == 1),
+    "Function 'assoc' passed %i arguments. "
+    "Expected a persistent map followed by key and value pairs.", a->count);
+  LASSERT_TYPE("assoc", a, 0, LVAL_PMAP);
+  
+  lval* p = lval_pop(a, 0);
+  lval* x = builtin_pmap_put(p, a, 0);
+  lval_del(p);
+  return x;
+}
+
+lval* builtin_dissoc(lenv* e, lval* a)
+{
+  LASSERT(a, (a->count > 0), "Function '%s' passed no arguments.", "dissoc");
+  LASSERT_TYPE("dissoc", a, 0, LVAL_PMAP);
+  
+  lval* p     = a->cell[0];
+  lval* root  = p->root ? lval_ref(p->root) : NULL;
+  int   nkeys = p->nkeys;
+  for (int i = 1; i < a->count; i++) {
+    int   removed;
+    lval* x = lhamt_dissoc(root, a->cell[i], &removed);
+    if (root) { lval_del(root); }
+    root   = x;
+    nkeys -= removed;
+  }
+  lval_del(a);
+  return lval_pmap(root, nkeys);
+}
+
+/* Vectors. Every function gives back a new vector, leaving the ones
+   passed to it as they were, see lvec.c. A vector of integers holds
+   Numbers and one of doubles Doubles, which is what come back out */
+
+/* 'vec {1 2 3}' makes a vector of integers, 'fvec {1 2.5 3}' of doubles,
+   which can be made from Numbers too */
+static lval* builtin_vec_make(lval* a, char* func, int elem)
+{
+  LASSERT_NUM(func, a, 1);
+  LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+  
+  lval* q = a->cell[0];
+  for (int i = 0; i < q->count; i++) {
+    int t = LVAL_TYPE(q->cell[i]);
+    LASSERT(a, (t == LVAL_NUM || (t == LVAL_DBL && elem == LVEC_DBL)),
+      "Function '%s' passed incorrect type for item %i. Got %s, Expected %s.",
+      func, i, ltype_name(t), ltype_name(elem == LVEC_INT ? LVAL_NUM : LVAL_DBL));
+  }
+  
+  lval* v = lval_vec(elem, q->count);
+  for (int i = 0; i < q->count; i++) {
+    if (elem == LVEC_INT) {
+      v->ints[i] = LVAL_NUM_VAL(q->cell[i]);
+    } else {
+      v->dbls[i] = LVAL_AS_DBL(q->cell[i]);
+    }
+  }
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_vec(lenv* e, lval* a)  { return builtin_vec_make(a, "vec", LVEC_INT); }
+lval* builtin_fvec(lenv* e, lval* a) { return builtin_vec_make(a, "fvec", LVEC_DBL); }
+
+/* 'vrange n' makes the integer vector 0 to n - 1 */
+lval* builtin_vrange(lenv* e, lval* a)
+{
+  LASSERT_NUM("vrange", a, 1);
+  LASSERT_TYPE("vrange", a, 0, LVAL_NUM);
+  
+  long n = LVAL_NUM_VAL(a->cell[0]);
+  LASSERT(a, (n >= 0 && n <= INT_MAX),
+    "Function 'vrange' passed %li. Expected a length from 0 to %i.", n, INT_MAX);
+  
+  lval* v = lval_vec(LVEC_INT, n);
+  for (int i = 0; i < n; i++) { v->ints[i] = i; }
+  lval_del(a);
+  return v;
+}
+
+/* d as the result of a, which is done with */
+static lval* builtin_vec_dbl(lval* a, double d)
+{
+  lval_del(a);
+  return lval_dbl(d);
+}
+
+/* Element i of v */
+static lval* builtin_vec_item(lval* v, int i)
+{
+  if (v->elem == LVEC_INT) { return lval_num(v->ints[i]); }
+  return lval_dbl(v->dbls[i]);
+}
+
+lval* builtin_vlist(lenv* e, lval* a)
+{
+  LASSERT_NUM("vlist", a, 1);
+  LASSERT_TYPE("vlist", a, 0, LVAL_VEC);
+  
+  lval* v = a->cell[0];
+  lval* q = lval_qexpr();
+  for (int i = 0; i < v->len; i++) { q = lval_add(q, builtin_vec_item(v, i)); }
+  lval_del(a);
+  return q;
+}
+
+lval* builtin_vlen(lenv* e, lval* a)
+{
+  LASSERT_NUM("vlen", a, 1);
+  LASSERT_TYPE("vlen", a, 0, LVAL_VEC);
+  
+  lval* r = lval_num(a->cell[0]->len);
+  lval_del(a);
+  return r;
+}
+
+/* 'vref v i' is element i of v, counting from 0 */
+lval* builtin_vref(lenv* e, lval* a)
+{
+  LASSERT_NUM("vref", a, 2);
+  LASSERT_TYPE("vref", a, 0, LVAL_VEC);
+  LASSERT_TYPE("vref", a, 1, LVAL_NUM);
+  
+  long i = LVAL_NUM_VAL(a->cell[1]);
+  LASSERT(a, (i >= 0 && i < a->cell[0]->len),
+    "Function 'vref' passed index %li. Expected 0 to %i.", i, a->cell[0]->len - 1);
+  
+  lval* r = builtin_vec_item(a->cell[0], i);
+  lval_del(a);
+  return r;
+}
+
+/* Element-wise functions take two vectors of the same length, or a
+   vector and a Number or Double to use for every element. They work in
+   doubles if either of them holds doubles. Gives NULL when a is fine */
+static lval* builtin_vec_check(lval* a, char* func)
+{
+  LASSERT_NUM(func, a, 2);
+  for (int i = 0; i < 2; i++) {
+    int t = LVAL_TYPE(a->cell[i]);
+    LASSERT(a, (t == LVAL_VEC || t == LVAL_NUM || t == LVAL_DBL),
+      "Function '%s' passed incorrect type for argument %i. "
+      "Got %s, Expected %s, %s or %s.", func, i, ltype_name(t),
+      ltype_name(LVAL_VEC), ltype_name(LVAL_NUM), ltype_name(LVAL_DBL));
+  }
+  
+  lval* x = a->cell[0];
+  lval* y = a->cell[1];
+  LASSERT(a, (LVAL_TYPE(x) == LVAL_VEC || LVAL_TYPE(y) == LVAL_VEC),
+    "Function '%s' passed no %s.", func, ltype_name(LVAL_VEC));
+  if (LVAL_TYPE(x) == LVAL_VEC && LVAL_TYPE(y) == LVAL_VEC) {
+    LASSERT(a, (x->len == y->len),
+      "Function '%s' passed vectors of different lengths. Got %i and %i.",
+      func, x->len, y->len);
+  }
+  return NULL;
+}
+
+static int builtin_vec_len(lval* a)
+{
+  lval* x = a->cell[0];
+  return LVAL_TYPE(x) == LVAL_VEC ? x->len : a->cell[1]->len;
+}
+
+static int builtin_vec_elem(lval* a)
+{
+  for (int i = 0; i < a->count; i++) {
+    lval* x = a->cell[i];
+    if (LVAL_TYPE(x) == LVAL_DBL) { return LVEC_DBL; }
+    if (LVAL_TYPE(x) == LVAL_VEC && x->elem == LVEC_DBL) { return LVEC_DBL; }
+  }
+  return LVEC_INT;
+}
+
+/* An operand as integers, the Number being put in one with stride 0 */
+static int64_t* builtin_vec_ints(lval* x, int64_t* one, int* stride)
+{
+  *stride = LVAL_TYPE(x) == LVAL_VEC;
+  if (*stride) { return x->ints; }
+  *one = LVAL_NUM_VAL(x);
+  return one;
+}
+
+/* An operand as doubles, converting an integer vector into an array
+   that builtin_vec_done frees */
+static double* builtin_vec_dbls(lval* x, double* one, int* stride)
+{
+  *stride = LVAL_TYPE(x) == LVAL_VEC;
+  if (!*stride) {
+    *one = LVAL_AS_DBL(x);
+    return one;
+  }
+  if (x->elem == LVEC_DBL) { return x->dbls; }
+  
+  double* d = malloc(sizeof(double) * (x->len ? x->len : 1));
+  for (int i = 0; i < x->len; i++) { d[i] = x->ints[i]; }
+  return d;
+}
+
+static void builtin_vec_done(lval* x, double* d)
+{
+  if (LVAL_TYPE(x) == LVAL_VEC && x->elem == LVEC_INT) { free(d); }
+}
+
+static lval* builtin_vec_arith(lval* a, char* func, int op)
+{
+  lval* err = builtin_vec_check(a, func);
+  if (err) { return err; }
+  
+  int   n    = builtin_vec_len(a);
+  int   elem = builtin_vec_elem(a);
+  lval* x    = a->cell[0];
+  lval* y    = a->cell[1];
+  lval* r    = lval_vec(elem, n);
+  char* msg  = NULL;
+  int   xs, ys;
+  
+  if (elem == LVEC_INT) {
+    int64_t bx, by;
+    int64_t* px = builtin_vec_ints(x, &bx, &xs);
+    int64_t* py = builtin_vec_ints(y, &by, &ys);
+    msg = lvec_arith_int(op, r->ints, px, xs, py, ys, n);
+  } else {
+    double bx, by;
+    double* px = builtin_vec_dbls(x, &bx, &xs);
+    double* py = builtin_vec_dbls(y, &by, &ys);
+    lvec_arith_dbl(op, r->dbls, px, xs, py, ys, n);
+    builtin_vec_done(x, px);
+    builtin_vec_done(y, py);
+  }
+  
+  lval_del(a);
+  if (msg) {
+    lval_del(r);
+    return lval_err(msg);
+  }
+  return r;
+}
+
+lval* builtin_vadd(lenv* e, lval* a) { return builtin_vec_arith(a, "v+", LVEC_ADD); }
+lval* builtin_vsub(lenv* e, lval* a) { return builtin_vec_arith(a, "v-", LVEC_SUB); }
+lval* builtin_vmul(lenv* e, lval* a) { return builtin_vec_arith(a, "v*", LVEC_MUL); }
+lval* builtin_vdiv(lenv* e, lval* a) { return builtin_vec_arith(a, "v/", LVEC_DIV); }
+
+/* Comparisons give an integer vector of 1 where they hold and 0 where
+   they don't */
+static lval* builtin_vec_compare(lval* a, char* func, int op)
+{
+  lval* err = builtin_vec_check(a, func);
+  if (err) { return err; }
+  
+  int   n = builtin_vec_len(a);
+  lval* x = a->cell[0];
+  lval* y = a->cell[1];
+  lval* r = lval_vec(LVEC_INT, n);
+  int   xs, ys;
+  
+  if (builtin_vec_elem(a) == LVEC_INT) {
+    int64_t bx, by;
+    int64_t* px = builtin_vec_ints(x, &bx, &xs);
+    int64_t* py = builtin_vec_ints(y, &by, &ys);
+    lvec_compare_int(op, r->ints, px, xs, py, ys, n);
+  } else {
+    double bx, by;
+    double* px = builtin_vec_dbls(x, &bx, &xs);
+    double* py = builtin_vec_dbls(y, &by, &ys);
+    lvec_compare_dbl(op, r->ints, px, xs, py, ys, n);
+    builtin_vec_done(x, px);
+    builtin_vec_done(y, py);
+  }
+  
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_veq(lenv* e, lval* a) { return builtin_vec_compare(a, "v==", LVEC_EQ); }
+lval* builtin_vlt(lenv* e, lval* a) { return builtin_vec_compare(a, "v<",  LVEC_LT); }
+lval* builtin_vgt(lenv* e, lval* a) { return builtin_vec_compare(a, "v>",  LVEC_GT); }
+lval* builtin_vle(lenv* e, lval* a) { return builtin_vec_compare(a, "v<=", LVEC_LE); }
+lval* builtin_vge(lenv* e, lval* a) { return builtin_vec_compare(a, "v>=", LVEC_GE); }
+
+lval* builtin_vsum(lenv* e, lval* a)
+{
+  LASSERT_NUM("vsum", a, 1);
+  LASSERT_TYPE("vsum", a, 0, LVAL_VEC);
+  
+  lval* v = a->cell[0];
+  if (v->elem == LVEC_DBL) {
+    return builtin_vec_dbl(a, lvec_sum_dbl(v->dbls, v->len));
+  }
+  
+  int64_t s;
+  char*   msg = lvec_sum_int(v->ints, v->len, &s);
+  lval_del(a);
+  return msg ? lval_err(msg) : lval_num(s);
+}
+
+static lval* builtin_vec_extreme(lval* a, char* func, int max)
+{
+  LASSERT_NUM(func, a, 1);
+  LASSERT_TYPE(func, a, 0, LVAL_VEC);
+  LASSERT(a, (a->cell[0]->len > 0), "Function '%s' passed an empty vector.", func);
+  
+  lval* v = a->cell[0];
+  if (v->elem == LVEC_DBL) {
+    return builtin_vec_dbl(a, lvec_extreme_dbl(max, v->dbls, v->len));
+  }
+  
+  lval* r = lval_num(lvec_extreme_int(max, v->ints, v->len));
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_vmin(lenv* e, lval* a) { return builtin_vec_extreme(a, "vmin", 0); }
+lval* builtin_vmax(lenv* e, lval* a) { return builtin_vec_extreme(a, "vmax", 1); }
+
+lval* builtin_vdot(lenv* e, lval* a)
+{
+  LASSERT_NUM("vdot", a, 2);
+  LASSERT_TYPE("vdot", a, 0, LVAL_VEC);
+  LASSERT_TYPE("vdot", a, 1, LVAL_VEC);
+  lval* err = builtin_vec_check(a, "vdot");
+  if (err) { return err; }
+  
+  lval* x = a->cell[0];
+  lval* y = a->cell[1];
+  if (builtin_vec_elem(a) == LVEC_INT) {
+    int64_t s;
+    char*   msg = lvec_dot_int(x->ints, y->ints, x->len, &s);
+    lval_del(a);
+    return msg ? lval_err(msg) : lval_num(s);
+  }
+  
+  int     xs, ys;
+  double  bx, by;
+  double* px = builtin_vec_dbls(x, &bx, &xs);
+  double* py = builtin_vec_dbls(y, &by, &ys);
+  double  d  = lvec_dot_dbl(px, py, x->len);
+  builtin_vec_done(x, px);
+  builtin_vec_done(y, py);
+  return builtin_vec_dbl(a, d);
+}
+
+/* 'vscan v' is the running sums of v */
+lval* builtin_vscan(lenv* e, lval* a)
+{
+  LASSERT_NUM("vscan", a, 1);
+  LASSERT_TYPE("vscan", a, 0, LVAL_VEC);
+  
+  lval* v   = a->cell[0];
+  lval* r   = lval_vec(v->elem, v->len);
+  char* msg = NULL;
+  if (v->elem == LVEC_INT) {
+    msg = lvec_scan_int(r->ints, v->ints, v->len);
+  } else {
+    lvec_scan_dbl(r->dbls, v->dbls, v->len);
+  }
+  
+  lval_del(a);
+  if (msg) {
+    lval_del(r);
+    return lval_err(msg);
+  }
+  return r;
+}
+
+/* The branch 'if' takes, or an error, see builtin_eval_expr */
+lval* builtin_if_expr(lval* a)
 {
   LASSERT_NUM("if", a, 3);
   LASSERT_TYPE("if", a, 0, LVAL_NUM);
   LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
   LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
   
-  lval* x = NULL;
-  a->cell[1]->type = LVAL_SEXPR;
-  a->cell[2]->type = LVAL_SEXPR;
-  
-  if(a->cell[0]->num)
-  {
-    x = lval_eval(e, lval_pop(a, 1));
-  }
-  else
-  {
-    x = lval_eval(e, lval_pop(a, 2));
-  }
+  /* Take the chosen branch, copying it if it is shared before
+     turning it into an S-Expression */
+  lval* x = lval_pop(a, LVAL_NUM_VAL(a->cell[0]) ? 1 : 2);
   lval_del(a);
+  
+  x = lval_unshare(x);
+  x->type = LVAL_SEXPR;
   return x;
 }
 
+lval* builtin_if(lenv* e, lval* a)
+{
+  return lval_eval(e, builtin_if_expr(a));
+}
+
 lval* builtin_load(lenv* e, lval* a) {
   LASSERT_NUM("load", a, 1);
   LASSERT_TYPE("load", a, 0, LVAL_STR);
@@ -255,8 +999,7 @@ lval* builtin_load(lenv* e, lval* a) {
     while (expr->count) {
       lval* v = lval_pop(expr, 0);
       lval* x = lval_eval(e, v);
-      lval_println(v);
-      if (x->type == LVAL_ERR) { lval_println(x); }
+      if (LVAL_TYPE(x) == LVAL_ERR) { lval_println(x); }
       lval_del(x);
     }
     
@@ -297,19 +1040,104 @@ lval* builtin_error(lenv* e, lval* a)
   return err;
 }
 
+/* Check if a stats section was asked for. An empty list means all of them */
+static int stats_section(lval* s, char* name)
+{
+  if (s->count == 0) { return 1; }
+  for (int i = 0; i < s->count; i++) {
+    if (strcmp(s->cell[i]->sym, name) == 0) { return 1; }
+  }
+  return 0;
+}
+
+lval* builtin_stats(lenv* e, lval* a)
+{
+  LASSERT_NUM("stats", a, 1);
+  LASSERT_TYPE("stats", a, 0, LVAL_QEXPR);
+  
+  lval* s = a->cell[0];
+  for (int i = 0; i < s->count; i++) {
+    LASSERT(a, (LVAL_TYPE(s->cell[i]) == LVAL_SYM),
+      "Function 'stats' passed non-symbol section. Got %s, Expected %s.",
+      ltype_name(LVAL_TYPE(s->cell[i])), ltype_name(LVAL_SYM));
+  }
+  
+  if (stats_section(s, "alloc")) { lalloc_print(); }
+  if (stats_section(s, "gc"))    { lgc_print(); }
+  if (stats_section(s, "vm"))    { lvm_print(); }
+  if (stats_section(s, "cache")) { lvm_print_cache(); }
+  if (stats_section(s, "jit"))   { ljit_print(); }
+  if (stats_section(s, "vec"))   { lvec_print(); }
+  
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* Set the knobs given to func as pairs, e.g. 'gc {threshold 5000}' */
+static lval* builtin_knobs(lval* a, char* func, int (*set)(char*, long))
+{
+  lval* k = a->cell[0];
+  LASSERT(a, (k->count % 2 == 0),
+    "Function '%s' passed %i items. Expected knob and value pairs.",
+    func, k->count);
+  
+  for (int i = 0; i < k->count; i += 2) {
+    LASSERT(a, (LVAL_TYPE(k->cell[i]) == LVAL_SYM),
+      "Function '%s' passed incorrect knob. Got %s, Expected %s.",
+      func, ltype_name(LVAL_TYPE(k->cell[i])), ltype_name(LVAL_SYM));
+    LASSERT(a, (LVAL_TYPE(k->cell[i+1]) == LVAL_NUM),
+      "Function '%s' passed incorrect value for '%s'. Got %s, Expected %s.",
+      func, k->cell[i]->sym, ltype_name(LVAL_TYPE(k->cell[i+1])),
+      ltype_name(LVAL_NUM));
+    LASSERT(a, set(k->cell[i]->sym, LVAL_NUM_VAL(k->cell[i+1])),
+      "Function '%s' passed unknown knob or invalid value for '%s'.",
+      func, k->cell[i]->sym);
+  }
+  
+  lval_del(a);
+  return lval_sexpr();
+}
+
+lval* builtin_gc(lenv* e, lval* a)
+{
+  LASSERT_NUM("gc", a, 1);
+  LASSERT_TYPE("gc", a, 0, LVAL_QEXPR);
+  
+  /* 'gc {}' collects now and returns the number of bytes freed */
+  if (a->cell[0]->count == 0) {
+    lval_del(a);
+    return lval_num(lgc_collect());
+  }
+  
+  return builtin_knobs(a, "gc", lgc_set);
+}
+
+/* 'limit {depth 1000}' bounds how deep evaluation can nest */
+lval* builtin_limit(lenv* e, lval* a)
+{
+  LASSERT_NUM("limit", a, 1);
+  LASSERT_TYPE("limit", a, 0, LVAL_QEXPR);
+  return builtin_knobs(a, "limit", lvm_set);
+}
+
+/* 'jit {threshold 100}' compiles lambdas after that many calls */
+lval* builtin_jit(lenv* e, lval* a)
+{
+  LASSERT_NUM("jit", a, 1);
+  LASSERT_TYPE("jit", a, 0, LVAL_QEXPR);
+  return builtin_knobs(a, "jit", ljit_set);
+}
+
+/* 'simd {level 0}' keeps vector kernels to plain loops, 1 to SSE2 */
+lval* builtin_simd(lenv* e, lval* a)
+{
+  LASSERT_NUM("simd", a, 1);
+  LASSERT_TYPE("simd", a, 0, LVAL_QEXPR);
+  return builtin_knobs(a, "simd", lvec_set);
+}
+
 lval* builtin_def(lenv* e, lval* a) { return builtin_var(e, a, "def"); }
 lval* builtin_put(lenv* e, lval* a) { return builtin_var(e, a, "="); }
-lval* builtin_add(lenv* e, lval* a) { return builtin_op(e, a, "+"); }
-lval* builtin_sub(lenv* e, lval* a) { return builtin_op(e, a, "-"); }
-lval* builtin_mul(lenv* e, lval* a) { return builtin_op(e, a, "*"); }
-lval* builtin_div(lenv* e, lval* a) { return builtin_op(e, a, "/"); }
-lval* builtin_mod(lenv* e, lval* a) { return builtin_op(e, a, "%"); }
-lval* builtin_gt(lenv* e, lval* a)  { return builtin_ord(e, a, ">"); }
-lval* builtin_lt(lenv* e, lval* a)  { return builtin_ord(e, a, "<"); }
-lval* builtin_ge(lenv* e, lval* a)  { return builtin_ord(e, a, ">="); }
-lval* builtin_le(lenv* e, lval* a)  { return builtin_ord(e, a, "<="); }
-lval* builtin_eq(lenv* e, lval* a)  { return builtin_cmp(e, a, "=="); }
-lval* builtin_ne(lenv* e, lval* a)  { return builtin_cmp(e, a, "!="); }
 
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func) 
 {
@@ -345,8 +1173,47 @@ void lenv_add_builtins(lenv* e)
   lenv_add_builtin(e, "<",  builtin_lt);
   lenv_add_builtin(e, ">=", builtin_ge);
   lenv_add_builtin(e, "<=", builtin_le);
+  lenv_add_builtin(e, "hash", builtin_hash);
+  /* Map Functions */
+  lenv_add_builtin(e, "map",    builtin_map);
+  lenv_add_builtin(e, "insert", builtin_insert);
+  lenv_add_builtin(e, "lookup", builtin_lookup);
+  lenv_add_builtin(e, "delete", builtin_delete);
+  lenv_add_builtin(e, "size",   builtin_size);
+  lenv_add_builtin(e, "keys",   builtin_keys);
+  lenv_add_builtin(e, "pairs",  builtin_pairs);
+  lenv_add_builtin(e, "pmap",   builtin_pmap);
+  lenv_add_builtin(e, "assoc",  builtin_assoc);
+  lenv_add_builtin(e, "dissoc", builtin_dissoc);
+  /* Vector Functions */
+  lenv_add_builtin(e, "vec",    builtin_vec);
+  lenv_add_builtin(e, "fvec",   builtin_fvec);
+  lenv_add_builtin(e, "vrange", builtin_vrange);
+  lenv_add_builtin(e, "vlist",  builtin_vlist);
+  lenv_add_builtin(e, "vlen",   builtin_vlen);
+  lenv_add_builtin(e, "vref",   builtin_vref);
+  lenv_add_builtin(e, "v+",     builtin_vadd);
+  lenv_add_builtin(e, "v-",     builtin_vsub);
+  lenv_add_builtin(e, "v*",     builtin_vmul);
+  lenv_add_builtin(e, "v/",     builtin_vdiv);
+  lenv_add_builtin(e, "v==",    builtin_veq);
+  lenv_add_builtin(e, "v<",     builtin_vlt);
+  lenv_add_builtin(e, "v>",     builtin_vgt);
+  lenv_add_builtin(e, "v<=",    builtin_vle);
+  lenv_add_builtin(e, "v>=",    builtin_vge);
+  lenv_add_builtin(e, "vsum",   builtin_vsum);
+  lenv_add_builtin(e, "vmin",   builtin_vmin);
+  lenv_add_builtin(e, "vmax",   builtin_vmax);
+  lenv_add_builtin(e, "vdot",   builtin_vdot);
+  lenv_add_builtin(e, "vscan",  builtin_vscan);
   /* String Functions */
   lenv_add_builtin(e, "load", builtin_load);
   lenv_add_builtin(e, "error", builtin_error);
   lenv_add_builtin(e, "print", builtin_print);
+  /* Runtime Functions */
+  lenv_add_builtin(e, "stats", builtin_stats);
+  lenv_add_builtin(e, "gc",    builtin_gc);
+  lenv_add_builtin(e, "limit", builtin_limit);
+  lenv_add_builtin(e, "jit",   builtin_jit);
+  lenv_add_builtin(e, "simd",  builtin_simd);
 }
@@ -0,0 +1,260 @@
+#include "lispy.h"
+
+/* Slab allocator for the fixed size lispy objects (lval and lenv).
+   Each object type gets its own pool. A pool carves fixed size objects
+   out of large slabs and keeps the objects released by lval_del/lenv_del
+   on a free list, so most allocations are a pointer pop instead of a
+   trip through malloc. Compile with -DLISPY_MALLOC to send every
+   allocation straight to malloc/free, e.g. for AddressSanitizer runs.
+
+   The garbage collector walks every live object of a pool. In a slab
+   that means skipping the free objects, which are marked by LFREE in
+   their first byte where a live lval keeps its type. With LISPY_MALLOC
+   each object is instead preceded by a hidden header linking it into a
+   list of the pool's live objects.
+
+   Minor collections only look at the lvals allocated since the last
+   collection. Slabs hand out objects in no particular order, so those
+   are appended to a log as they are allocated. The log can point at
+   objects that have since been freed, or freed and reused by a newer
+   object, so the collector checks each entry. With LISPY_MALLOC new
+   objects go to the front of the list, and the young ones are simply
+   those in front of the first tenured object. */
+
+#define LSLAB_SIZE  (64 * 1024)
+#define LSIZE_CLASS 16
+#define LFREE       0xFF
+#define LYOUNG_MAX  (1 << 20)
+
+typedef struct lpool  lpool;
+typedef struct lslab  lslab;
+typedef struct lfree  lfree;
+typedef struct lblock lblock;
+
+struct lslab  { lslab* next; };
+struct lfree  { unsigned char mark; lfree* next; };
+struct lblock { lblock* prev; lblock* next; };
+
+struct lpool
+{
+  char*  name;
+  size_t size;
+
+  /* Recycled objects and the unused tail of the newest slab */
+  lfree* free;
+  char*  bump;
+  char*  end;
+  lslab* slabs;
+
+  /* Live objects when using malloc, newest first */
+  lblock* blocks;
+  lblock* tenured;
+
+  /* Counters */
+  unsigned long allocs;
+  unsigned long frees;
+  unsigned long reused;
+  unsigned long nslabs;
+};
+
+/* round object sizes up to their size class */
+#define LCLASS(s) (((s) + LSIZE_CLASS - 1) / LSIZE_CLASS * LSIZE_CLASS)
+
+/* slab objects start after the slab header, aligned to the size class */
+#define LSLAB_HEAD  LCLASS(sizeof(lslab))
+#define LBLOCK_HEAD LCLASS(sizeof(lblock))
+
+/* the compact lval layout relies on two values sharing a cache line */
+_Static_assert(sizeof(lval) <= 32, "lval should fit in half a cache line");
+
+static lpool lval_pool = { .name = "lval", .size = LCLASS(sizeof(lval)) };
+static lpool lenv_pool = { .name = "lenv", .size = LCLASS(sizeof(lenv)) };
+
+/* lvals allocated since the last collection */
+static lval** young;
+static size_t nyoung;
+static size_t young_cap;
+
+static void* lpool_alloc(lpool* p)
+{
+  p->allocs++;
+
+#ifdef LISPY_MALLOC
+  lblock* b = malloc(LBLOCK_HEAD + p->size);
+  b->prev = NULL;
+  b->next = p->blocks;
+  if (p->blocks) { p->blocks->prev = b; }
+  p->blocks = b;
+  return (char*)b + LBLOCK_HEAD;
+#else
+  /* Reuse a freed object if there is one */
+  if (p->free)
+  {
+    lfree* x = p->free;
+    p->free = x->next;
+    p->reused++;
+    return x;
+  }
+
+  /* Otherwise carve one from the current slab, starting a new one if full */
+  if (p->bump + p->size > p->end)
+  {
+    lslab* s = malloc(LSLAB_SIZE);
+    s->next  = p->slabs;
+    p->slabs = s;
+    p->bump  = (char*)s + LSLAB_HEAD;
+    p->end   = (char*)s + LSLAB_SIZE;
+    p->nslabs++;
+  }
+
+  void* x = p->bump;
+  p->bump += p->size;
+  return x;
+#endif
+}
+
+static void lpool_free(lpool* p, void* x)
+{
+  p->frees++;
+
+#ifdef LISPY_MALLOC
+  lblock* b = (lblock*)((char*)x - LBLOCK_HEAD);
+  if (b == p->tenured) { p->tenured = b->next; }
+  if (b->prev) { b->prev->next = b->next; } else { p->blocks = b->next; }
+  if (b->next) { b->next->prev = b->prev; }
+  free(b);
+#else
+  lfree* f = x;
+  f->mark  = LFREE;
+  f->next  = p->free;
+  p->free  = f;
+#endif
+}
+
+/* Call fn on every live object of the pool. fn must not free objects */
+static void lpool_each(lpool* p, void (*fn)(void*))
+{
+#ifdef LISPY_MALLOC
+  for (lblock* b = p->blocks; b; b = b->next)
+  {
+    fn((char*)b + LBLOCK_HEAD);
+  }
+#else
+  for (lslab* s = p->slabs; s; s = s->next)
+  {
+    /* The newest slab is only used up to the bump pointer */
+    char* end = (s == p->slabs) ? p->bump : (char*)s + LSLAB_SIZE;
+    for (char* x = (char*)s + LSLAB_HEAD; x + p->size <= end; x += p->size)
+    {
+      if (*(unsigned char*)x != LFREE) { fn(x); }
+    }
+  }
+#endif
+}
+
+static void lpool_cleanup(lpool* p)
+{
+  while (p->slabs)
+  {
+    lslab* s = p->slabs;
+    p->slabs = s->next;
+    free(s);
+  }
+  while (p->blocks)
+  {
+    lblock* b = p->blocks;
+    p->blocks = b->next;
+    free(b);
+  }
+  p->free = NULL;
+  p->bump = p->end = NULL;
+}
+
+static void lpool_print(lpool* p)
+{
+  double hits = p->allocs ? 100.0 * p->reused / p->allocs : 0.0;
+  printf("%s : %lu allocs, %lu frees, %lu live, %lu reused (%.1f%% hit), "
+    "%lu slabs of %i bytes, %lu bytes per object\n",
+    p->name, p->allocs, p->frees, p->allocs - p->frees, p->reused, hits,
+    p->nslabs, LSLAB_SIZE, (unsigned long)p->size);
+}
+
+lval* lval_alloc(void)
+{
+  lval* v = lpool_alloc(&lval_pool);
+
+#ifndef LISPY_MALLOC
+  /* Stop logging if collections are off for a long time. Objects missing
+     from the log are still found by a full collection */
+  if (nyoung == young_cap && young_cap < LYOUNG_MAX)
+  {
+    young_cap = young_cap ? young_cap * 2 : 1024;
+    young = realloc(young, sizeof(lval*) * young_cap);
+  }
+  if (nyoung < young_cap) { young[nyoung++] = v; }
+#endif
+
+  return v;
+}
+
+void  lval_free(lval* v)  { lpool_free(&lval_pool, v); }
+lenv* lenv_alloc(void)    { return lpool_alloc(&lenv_pool); }
+void  lenv_free(lenv* e)  { lpool_free(&lenv_pool, e); }
+
+static void (*lval_each_fn)(lval*);
+static void lval_each_call(void* x) { lval_each_fn(x); }
+
+void lval_each(void (*fn)(lval*))
+{
+  lval_each_fn = fn;
+  lpool_each(&lval_pool, lval_each_call);
+}
+
+/* Call fn on the lvals allocated since lval_tenure was last called. It
+   may see the same object more than once. fn must not free objects */
+void lval_each_young(void (*fn)(lval*))
+{
+#ifdef LISPY_MALLOC
+  for (lblock* b = lval_pool.blocks; b != lval_pool.tenured; b = b->next)
+  {
+    fn((lval*)((char*)b + LBLOCK_HEAD));
+  }
+#else
+  for (size_t i = 0; i < nyoung; i++)
+  {
+    if (*(unsigned char*)young[i] != LFREE) { fn(young[i]); }
+  }
+#endif
+}
+
+void lval_tenure(void)
+{
+  nyoung = 0;
+  lval_pool.tenured = lval_pool.blocks;
+}
+
+unsigned long lalloc_count(void)
+{
+  return lval_pool.allocs + lenv_pool.allocs;
+}
+
+size_t lalloc_live_bytes(void)
+{
+  return (lval_pool.allocs - lval_pool.frees) * lval_pool.size
+       + (lenv_pool.allocs - lenv_pool.frees) * lenv_pool.size;
+}
+
+void lalloc_print(void)
+{
+  lpool_print(&lval_pool);
+  lpool_print(&lenv_pool);
+}
+
+void lalloc_cleanup(void)
+{
+  free(young);
+  young = NULL;
+  nyoung = young_cap = 0;
+  lpool_cleanup(&lval_pool);
+  lpool_cleanup(&lenv_pool);
+}
@@ -0,0 +1,416 @@
+#include "lispy.h"
+#include <time.h>
+
+/* Tracing garbage collector.
+
+   Reference counting frees a value as soon as its last reference is
+   dropped, but values that refer to each other in a cycle keep each
+   other's counts above zero forever. The collector traces the heap to
+   find and free such cycles.
+
+   Roots are never registered explicitly. Everything that refers to a
+   value from outside the traced heap, like the global lenv, the values
+   and frames of the evaluator and the temporaries of a builtin in
+   progress, holds a reference that shows up in the count. So:
+
+   1. For every container in the heap, remove the references it holds
+      from the counts of its children.
+   2. A container whose count is still above zero is referenced from
+      outside the heap and is a root. Mark everything reachable from
+      the roots, giving the references back as the edges are followed.
+   3. Whatever is left unmarked is only kept alive by other garbage.
+      Give its references back too and free it.
+
+   Only containers (S-Expressions, Q-Expressions, the cell buffers behind
+   them, maps, lambdas, their compiled bodies and environments) are traced,
+   since nothing else can be part of a cycle. The most common cycle is a
+   lambda bound in the environment it closes over.
+
+   Most values die young, and the ones that survive a collection tend to
+   survive the next ones too, so the heap is split in two generations.
+   A minor collection only scans the containers allocated since the last
+   collection and promotes the survivors to the old generation. It is
+   the same algorithm run over fewer candidates: steps 1 and 3 only touch
+   edges between candidates, and a reference from an old container to a
+   young one is left in the count, making the young one a root. That is
+   the job a write barrier does in a tracing collector, and the counts
+   already do it for free. A full collection scans every container and
+   runs once the old generation has grown by enough, which is the only
+   way to free a cycle that has been promoted.
+
+   Collections run at a safe point in the evaluator once enough objects
+   have been allocated, or when asked to with the 'gc' builtin. */
+
+static struct
+{
+  /* Knobs */
+  unsigned long threshold; /* allocations between collections, 0 to disable */
+  unsigned long growth;    /* percent the old generation grows before a full one */
+
+  /* Allocation count that triggers the next collection */
+  unsigned long next;
+
+  /* Containers promoted since the last full collection, and the number
+     that survived it */
+  unsigned long promoted;
+  unsigned long old;
+
+  /* Candidates, mark stack and garbage of the current collection */
+  lval** scan;
+  int    nscan;
+  int    scan_cap;
+  lval** stack;
+  int    sp;
+  int    stack_cap;
+  lval** garbage;
+  int    ngarbage;
+  int    garbage_cap;
+
+  /* Stats */
+  unsigned long minors;
+  unsigned long fulls;
+  unsigned long freed;
+  unsigned long freed_bytes;
+  unsigned long last_freed;
+  unsigned long last_freed_bytes;
+  double minor_last;
+  double minor_max;
+  double minor_total;
+  double full_last;
+  double full_max;
+  double full_total;
+} gc = { .threshold = 10000, .growth = 100, .next = 10000 };
+
+static int lgc_traced(lval* v)
+{
+  if (LVAL_IS_IMMEDIATE(v)) { return 0; }
+  switch (v->type) {
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+    case LVAL_CELLS:
+    case LVAL_CODE:
+    case LVAL_ENV:
+    case LVAL_MAP:
+    case LVAL_NODE:  return 1;
+    case LVAL_PMAP:  return v->root != NULL;
+    case LVAL_FUN:   return !LVAL_IS_BUILTIN(v);
+  }
+  return 0;
+}
+
+/* Call fn on every traced child of a container */
+static void lgc_children(lval* v, void (*fn)(lval*))
+{
+  switch (v->type) {
+    case LVAL_FUN:
+      fn(v->env);
+      if (lgc_traced(v->formals)) { fn(v->formals); }
+      if (lgc_traced(v->body))    { fn(v->body); }
+      return;
+    case LVAL_ENV:
+      if (v->outer) { fn(v->outer); }
+      for (int i = 0; i < LENV_SIZE(v->vars); i++)
+      {
+        lval* x = LENV_VAL(v->vars, i);
+        if (x && lgc_traced(x)) { fn(x); }
+      }
+      return;
+    case LVAL_CELLS:
+      for (int i = v->lo; i < v->used && !LVAL_IS_PACKED(v); i++)
+      {
+        if (lgc_traced(v->items[i])) { fn(v->items[i]); }
+      }
+      return;
+    case LVAL_CODE:
+      fn(v->src);
+      fn(lvm_formals(v->code));
+      for (int i = 0; i < lvm_ncaches(v->code); i++)
+      {
+        lval* x = lvm_cache(v->code, i);
+        if (x && lgc_traced(x)) { fn(x); }
+      }
+      return;
+    case LVAL_MAP:
+      for (int i = lmap_next(v->map, 0); i >= 0; i = lmap_next(v->map, i + 1))
+      {
+        if (lgc_traced(lmap_key(v->map, i))) { fn(lmap_key(v->map, i)); }
+        if (lgc_traced(lmap_val(v->map, i))) { fn(lmap_val(v->map, i)); }
+      }
+      return;
+    case LVAL_PMAP:
+      fn(v->root);
+      return;
+    case LVAL_NODE:
+      for (int i = 0; i < 2 * v->nkids; i++)
+      {
+        if (v->kids[i] && lgc_traced(v->kids[i])) { fn(v->kids[i]); }
+      }
+      return;
+  }
+
+  if (v->flags & LVAL_SHARED)
+  {
+    fn(v->cells);
+    return;
+  }
+  if (LVAL_IS_PACKED(v)) { return; }
+
+  /* Cells being evaluated are NULL, see lvm_walk */
+  for (int i = 0; i < v->count; i++)
+  {
+    if (v->cell[i] && lgc_traced(v->cell[i])) { fn(v->cell[i]); }
+  }
+}
+
+static void lgc_push(lval** list[], int* n, int* cap, lval* v)
+{
+  if (*n == *cap)
+  {
+    *cap  = *cap ? *cap * 2 : 256;
+    *list = realloc(*list, sizeof(lval*) * *cap);
+  }
+  (*list)[(*n)++] = v;
+}
+
+/* Only edges between candidates are removed and given back */
+static void lgc_unref(lval* v) { if (v->flags & LVAL_SCAN) { v->refs--; } }
+static void lgc_reref(lval* v) { if (v->flags & LVAL_SCAN) { v->refs++; } }
+
+static void lgc_mark(lval* v)
+{
+  if (v->flags & LVAL_MARK) { return; }
+  v->flags |= LVAL_MARK;
+  lgc_push(&gc.stack, &gc.sp, &gc.stack_cap, v);
+}
+
+/* Following an edge from a live container gives its reference back */
+static void lgc_mark_child(lval* v)
+{
+  if (!(v->flags & LVAL_SCAN)) { return; }
+  v->refs++;
+  lgc_mark(v);
+}
+
+static void lgc_candidate(lval* v)
+{
+  if (!lgc_traced(v) || (v->flags & LVAL_SCAN)) { return; }
+  v->flags |= LVAL_SCAN;
+  lgc_push(&gc.scan, &gc.nscan, &gc.scan_cap, v);
+}
+
+/* The young log can hold old objects that were freed and reused */
+static void lgc_young(lval* v)
+{
+  if (!(v->flags & LVAL_OLD)) { lgc_candidate(v); }
+}
+
+/* Drop everything a garbage container refers to, leaving an empty
+   S-Expression behind that lval_del can free like any other */
+static void lgc_clear(lval* v)
+{
+  switch (v->type) {
+    case LVAL_FUN:
+      lval_del(v->env);
+      lval_del(v->formals);
+      lval_del(v->body);
+      break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      if (v->flags & LVAL_SHARED)
+      {
+        lval_del(v->cells);
+        break;
+      }
+      for (int i = 0; i < v->count; i++) { lval_del(v->cell[i]); }
+      free(v->cell - v->start);
+      break;
+    case LVAL_CELLS:
+      for (int i = v->lo; i < v->used; i++) { lval_del(v->items[i]); }
+      free(v->items);
+      break;
+    case LVAL_CODE:
+      lval_del(v->src);
+      lvm_free(v->code);
+      break;
+    case LVAL_ENV:
+      lenv_del(v->vars);
+      if (v->outer) { lval_del(v->outer); }
+      break;
+    case LVAL_MAP:
+      lmap_free(v->map);
+      break;
+    case LVAL_PMAP:
+      if (v->root) { lval_del(v->root); }
+      break;
+    case LVAL_NODE:
+      for (int i = 0; i < 2 * v->nkids; i++)
+      {
+        if (v->kids[i]) { lval_del(v->kids[i]); }
+      }
+      free(v->kids);
+      break;
+  }
+
+  v->type  = LVAL_SEXPR;
+  v->flags = 0;
+  v->count = 0;
+  v->start = 0;
+  v->cap   = 0;
+  v->cell  = NULL;
+}
+
+static double lgc_now(void)
+{
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Free the cycles among the candidates, returning the number of
+   survivors, which are promoted to the old generation */
+static unsigned long lgc_run(void)
+{
+  /* Remove internal references, then mark from what is left */
+  for (int i = 0; i < gc.nscan; i++) { lgc_children(gc.scan[i], lgc_unref); }
+  for (int i = 0; i < gc.nscan; i++)
+  {
+    if (gc.scan[i]->refs > 0) { lgc_mark(gc.scan[i]); }
+  }
+  while (gc.sp > 0)
+  {
+    lgc_children(gc.stack[--gc.sp], lgc_mark_child);
+  }
+
+  /* Collect the unmarked containers, restoring their references. This
+     needs the candidate flags, so the survivors are only promoted after */
+  for (int i = 0; i < gc.nscan; i++)
+  {
+    lval* v = gc.scan[i];
+    if (v->flags & LVAL_MARK) { continue; }
+    lgc_children(v, lgc_reref);
+    lgc_push(&gc.garbage, &gc.ngarbage, &gc.garbage_cap, v);
+  }
+
+  unsigned long survivors = gc.nscan - gc.ngarbage;
+  for (int i = 0; i < gc.nscan; i++)
+  {
+    lval* v = gc.scan[i];
+    if (v->flags & LVAL_MARK)
+    {
+      v->flags = (v->flags & ~(LVAL_MARK | LVAL_SCAN)) | LVAL_OLD;
+    }
+  }
+  gc.nscan = 0;
+
+  /* Hold on to all the garbage while clearing it, so clearing one
+     container can't free another we are still going to visit */
+  for (int i = 0; i < gc.ngarbage; i++) { lval_ref(gc.garbage[i]); }
+  for (int i = 0; i < gc.ngarbage; i++) { lgc_clear(gc.garbage[i]); }
+  for (int i = 0; i < gc.ngarbage; i++) { lval_del(gc.garbage[i]); }
+  gc.last_freed = gc.ngarbage;
+  gc.freed += gc.ngarbage;
+  gc.ngarbage = 0;
+
+  /* Everything still alive is old now */
+  lval_tenure();
+  gc.next = lalloc_count() + gc.threshold;
+
+  return survivors;
+}
+
+static double lgc_finish(double start, size_t before)
+{
+  size_t after = lalloc_live_bytes();
+  gc.last_freed_bytes = before > after ? before - after : 0;
+  gc.freed_bytes += gc.last_freed_bytes;
+  return lgc_now() - start;
+}
+
+size_t lgc_minor(void)
+{
+  double start  = lgc_now();
+  size_t before = lalloc_live_bytes();
+
+  lval_each_young(lgc_young);
+  gc.promoted += lgc_run();
+
+  double pause = lgc_finish(start, before);
+  gc.minors++;
+  gc.minor_last   = pause;
+  gc.minor_total += pause;
+  if (pause > gc.minor_max) { gc.minor_max = pause; }
+
+  return gc.last_freed_bytes;
+}
+
+size_t lgc_collect(void)
+{
+  double start  = lgc_now();
+  size_t before = lalloc_live_bytes();
+
+  lval_each(lgc_candidate);
+  gc.old = lgc_run();
+  gc.promoted = 0;
+
+  double pause = lgc_finish(start, before);
+  gc.fulls++;
+  gc.full_last   = pause;
+  gc.full_total += pause;
+  if (pause > gc.full_max) { gc.full_max = pause; }
+
+  return gc.last_freed_bytes;
+}
+
+void lgc_poll(void)
+{
+  if (!gc.threshold || lalloc_count() < gc.next) { return; }
+
+  /* Go for a full collection once the old generation has grown enough */
+  unsigned long grow = gc.old * gc.growth / 100;
+  if (gc.promoted >= (grow > gc.threshold ? grow : gc.threshold)) {
+    lgc_collect();
+  } else {
+    lgc_minor();
+  }
+}
+
+int lgc_set(char* knob, long value)
+{
+  if (value < 0) { return 0; }
+
+  if (strcmp(knob, "threshold") == 0) {
+    gc.threshold = value;
+    gc.next = lalloc_count() + value;
+    return 1;
+  }
+  if (strcmp(knob, "growth") == 0) {
+    gc.growth = value;
+    return 1;
+  }
+  return 0;
+}
+
+void lgc_print(void)
+{
+  printf("gc : %lu minor, %lu full collections, %lu containers freed "
+    "(%lu bytes), last %lu freed (%lu bytes)\n",
+    gc.minors, gc.fulls, gc.freed, gc.freed_bytes,
+    gc.last_freed, gc.last_freed_bytes);
+  printf("gc : minor pause last %.3f ms, max %.3f ms, total %.3f ms\n",
+    gc.minor_last, gc.minor_max, gc.minor_total);
+  printf("gc : full pause last %.3f ms, max %.3f ms, total %.3f ms\n",
+    gc.full_last, gc.full_max, gc.full_total);
+  printf("gc : %lu old containers, %lu promoted since the last full collection\n",
+    gc.old, gc.promoted);
+  printf("gc : threshold %lu allocations, growth %lu%%, next at %lu\n",
+    gc.threshold, gc.growth, gc.next);
+}
+
+void lgc_cleanup(void)
+{
+  free(gc.scan);
+  free(gc.stack);
+  free(gc.garbage);
+  gc.scan = gc.stack = gc.garbage = NULL;
+  gc.scan_cap = gc.stack_cap = gc.garbage_cap = 0;
+}
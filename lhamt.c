@@ -0,0 +1,274 @@
+#include "lispy.h"
+
+/* Hash array mapped trie behind LVAL_PMAP.
+
+   A persistent map never changes. Adding or removing a key makes a new
+   version that shares all but the path from the root to that key with
+   the old one, so each costs O(log32 n) time and space however many
+   versions are around.
+
+   The trie is made of LVAL_NODE values. Each node branches on the next
+   5 bits of the hash of a key. Rather than 32 slots it only keeps the
+   ones in use, in order, with a bit set in bitmap for each. The slot for
+   a branch is the number of bits set below its own. A slot is a key
+   and its value, or NULL and the node below for keys sharing these
+   bits of their hash.
+
+   Once the 32 bits of the hash are used up, the keys left share the
+   whole hash and a node just keeps them in a list.
+
+   A node that is left with a single key after a removal gives it to
+   the node above, so the trie stays as shallow as it can.
+
+   Nodes are reference counted like any other value, so versions share
+   them, and lookups only ever read them. */
+
+#define LHAMT_BITS 5
+#define LHAMT_MASK 31
+
+static int lhamt_full(int shift) { return shift >= 32; }
+
+static uint32_t lhamt_bit(uint32_t h, int shift)
+{
+  return 1u << ((h >> shift) & LHAMT_MASK);
+}
+
+static int lhamt_index(lval* node, uint32_t bit)
+{
+  return __builtin_popcount(node->bitmap & (bit - 1));
+}
+
+/* A node with room for n slots, which the caller fills */
+static lval* lhamt_node(uint32_t bitmap, int n)
+{
+  lval* x   = lval_alloc();
+  x->type   = LVAL_NODE;
+  x->flags  = 0;
+  x->refs   = 1;
+  x->bitmap = bitmap;
+  x->nkids  = n;
+  x->kids   = malloc(sizeof(lval*) * 2 * (n ? n : 1));
+  return x;
+}
+
+/* A copy of the slots of node, with slot i dropped (del) or room made
+   for a new one at i (add), holding references to the ones it keeps */
+static lval* lhamt_copy(lval* node, uint32_t bitmap, int i, int del, int add)
+{
+  int   n = node->nkids - del + add;
+  lval* x = lhamt_node(bitmap, n);
+  for (int j = 0, k = 0; j < node->nkids; j++) {
+    if (del && j == i) { continue; }
+    if (add && k == i) { k++; }
+    x->kids[2*k]   = node->kids[2*j] ? lval_ref(node->kids[2*j]) : NULL;
+    x->kids[2*k+1] = lval_ref(node->kids[2*j+1]);
+    k++;
+  }
+  return x;
+}
+
+static void lhamt_set(lval* x, int i, lval* k, lval* v)
+{
+  x->kids[2*i]   = k;
+  x->kids[2*i+1] = v;
+}
+
+static void lhamt_replace(lval* x, int i, lval* k, lval* v)
+{
+  if (x->kids[2*i]) { lval_del(x->kids[2*i]); }
+  lval_del(x->kids[2*i+1]);
+  lhamt_set(x, i, k, v);
+}
+
+lval* lhamt_get(lval* node, lval* k)
+{
+  uint32_t h = lval_hash(k);
+  for (int shift = 0; node; shift += LHAMT_BITS) {
+    if (lhamt_full(shift)) {
+      for (int i = 0; i < node->nkids; i++) {
+        if (lval_eq(node->kids[2*i], k)) { return node->kids[2*i+1]; }
+      }
+      return NULL;
+    }
+
+    uint32_t bit = lhamt_bit(h, shift);
+    if (!(node->bitmap & bit)) { return NULL; }
+    int i = lhamt_index(node, bit);
+    if (node->kids[2*i]) {
+      return lval_eq(node->kids[2*i], k) ? node->kids[2*i+1] : NULL;
+    }
+    node = node->kids[2*i+1];
+  }
+  return NULL;
+}
+
+/* A node holding the two keys a and b, with hashes ha and hb, which
+   agree below shift */
+static lval* lhamt_pair(int shift, uint32_t ha, lval* a, lval* va,
+  uint32_t hb, lval* b, lval* vb)
+{
+  if (lhamt_full(shift)) {
+    lval* x = lhamt_node(0, 2);
+    lhamt_set(x, 0, a, va);
+    lhamt_set(x, 1, b, vb);
+    return x;
+  }
+
+  uint32_t ba = lhamt_bit(ha, shift);
+  uint32_t bb = lhamt_bit(hb, shift);
+  if (ba == bb) {
+    lval* x = lhamt_node(ba, 1);
+    lhamt_set(x, 0, NULL, lhamt_pair(shift + LHAMT_BITS, ha, a, va, hb, b, vb));
+    return x;
+  }
+
+  lval* x = lhamt_node(ba | bb, 2);
+  int   i = ba < bb ? 0 : 1;
+  lhamt_set(x, i, a, va);
+  lhamt_set(x, 1 - i, b, vb);
+  return x;
+}
+
+static lval* lhamt_assoc_at(lval* node, int shift, uint32_t h,
+  lval* k, lval* v, int* added)
+{
+  if (lhamt_full(shift)) {
+    for (int i = 0; i < node->nkids; i++) {
+      if (!lval_eq(node->kids[2*i], k)) { continue; }
+      lval* x = lhamt_copy(node, 0, 0, 0, 0);
+      lhamt_replace(x, i, lval_ref(k), lval_ref(v));
+      return x;
+    }
+    lval* x = lhamt_copy(node, 0, node->nkids, 0, 1);
+    lhamt_set(x, node->nkids, lval_ref(k), lval_ref(v));
+    *added = 1;
+    return x;
+  }
+
+  uint32_t bit = lhamt_bit(h, shift);
+  int      i   = lhamt_index(node, bit);
+
+  if (!(node->bitmap & bit)) {
+    lval* x = lhamt_copy(node, node->bitmap | bit, i, 0, 1);
+    lhamt_set(x, i, lval_ref(k), lval_ref(v));
+    *added = 1;
+    return x;
+  }
+
+  lval* key = node->kids[2*i];
+  lval* sub;
+  if (!key) {
+    sub = lhamt_assoc_at(node->kids[2*i+1], shift + LHAMT_BITS, h, k, v, added);
+  } else if (lval_eq(key, k)) {
+    lval* x = lhamt_copy(node, node->bitmap, 0, 0, 0);
+    lhamt_replace(x, i, lval_ref(k), lval_ref(v));
+    return x;
+  } else {
+    /* Two keys in one slot push each other a level down */
+    sub = lhamt_pair(shift + LHAMT_BITS,
+      lval_hash(key), lval_ref(key), lval_ref(node->kids[2*i+1]),
+      h, lval_ref(k), lval_ref(v));
+    *added = 1;
+  }
+
+  lval* x = lhamt_copy(node, node->bitmap, 0, 0, 0);
+  lhamt_replace(x, i, NULL, sub);
+  return x;
+}
+
+/* A new trie with k bound to v. root may be NULL for an empty one, and
+   is left as it is, as are k and v */
+lval* lhamt_assoc(lval* root, lval* k, lval* v, int* added)
+{
+  *added = 0;
+  if (!root) {
+    root = lhamt_node(0, 0);
+    lval* x = lhamt_assoc_at(root, 0, lval_hash(k), k, v, added);
+    lval_del(root);
+    return x;
+  }
+  return lhamt_assoc_at(root, 0, lval_hash(k), k, v, added);
+}
+
+/* Whether node is down to a single key it can give to the node above */
+static int lhamt_single(lval* node)
+{
+  return node->nkids == 1 && node->kids[0];
+}
+
+static lval* lhamt_dissoc_at(lval* node, int shift, uint32_t h,
+  lval* k, int* removed)
+{
+  if (lhamt_full(shift)) {
+    for (int i = 0; i < node->nkids; i++) {
+      if (!lval_eq(node->kids[2*i], k)) { continue; }
+      *removed = 1;
+      return node->nkids == 1 ? NULL : lhamt_copy(node, 0, i, 1, 0);
+    }
+    return lval_ref(node);
+  }
+
+  uint32_t bit = lhamt_bit(h, shift);
+  if (!(node->bitmap & bit)) { return lval_ref(node); }
+  int i = lhamt_index(node, bit);
+
+  lval* key = node->kids[2*i];
+  if (key) {
+    if (!lval_eq(key, k)) { return lval_ref(node); }
+    *removed = 1;
+    if (node->nkids == 1) { return NULL; }
+    return lhamt_copy(node, node->bitmap & ~bit, i, 1, 0);
+  }
+
+  lval* sub = lhamt_dissoc_at(node->kids[2*i+1], shift + LHAMT_BITS, h, k, removed);
+  if (sub == node->kids[2*i+1]) {
+    lval_del(sub);
+    return lval_ref(node);
+  }
+
+  if (!sub) {
+    if (node->nkids == 1) { return NULL; }
+    return lhamt_copy(node, node->bitmap & ~bit, i, 1, 0);
+  }
+
+  /* A node with one key left gives it to this one, which may in turn
+     have only that key, and give it on up */
+  lval* x = lhamt_copy(node, node->bitmap, 0, 0, 0);
+  if (lhamt_single(sub)) {
+    lhamt_replace(x, i, lval_ref(sub->kids[0]), lval_ref(sub->kids[1]));
+    lval_del(sub);
+  } else {
+    lhamt_replace(x, i, NULL, sub);
+  }
+  return x;
+}
+
+/* A new trie without k, or NULL if it is empty. root is left as it is */
+lval* lhamt_dissoc(lval* root, lval* k, int* removed)
+{
+  *removed = 0;
+  if (!root) { return NULL; }
+  return lhamt_dissoc_at(root, 0, lval_hash(k), k, removed);
+}
+
+static void lhamt_walk(lval* node, lval** out, int* n)
+{
+  for (int i = 0; i < node->nkids; i++) {
+    if (node->kids[2*i]) {
+      out[(*n)++] = node->kids[2*i];
+      out[(*n)++] = node->kids[2*i+1];
+    } else {
+      lhamt_walk(node->kids[2*i+1], out, n);
+    }
+  }
+}
+
+/* The keys and values of the count entries under root, alternating, in
+   an array the caller frees. The trie is at most 8 nodes deep */
+lval** lhamt_entries(lval* root, int count)
+{
+  lval** out = malloc(sizeof(lval*) * 2 * (count ? count : 1));
+  int    n   = 0;
+  if (root) { lhamt_walk(root, out, &n); }
+  return out;
+}
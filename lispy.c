@@ -25,129 +25,89 @@ void add_history(char* unused) {}
 lval* lval_call(lenv* e, lval* f, lval* a) {
   
   /* If Builtin then simply apply that */
-  if (f->builtin) { return f->builtin(e, a); }
+  if (LVAL_IS_BUILTIN(f)) { return f->builtin(e, a); }
+  
+  /* Otherwise run the body once all the formals are bound */
+  lval* x = lval_bind(f, a);
+  if (LVAL_TYPE(x) != LVAL_ENV) { return x; }
+  return lvm_run(f, x);
+}
+
+/* Bind the arguments a to the formals of the lambda f in a new frame
+   inside the environment f closes over. Returns an error, a partial
+   application if formals are left, or the frame (an LVAL_ENV) to run
+   the body of f in with lvm_run. f itself is left as it is */
+lval* lval_bind(lval* f, lval* a) {
+  
+  lval* formals = f->formals;
+  lval* frame   = lval_env(f->env);
+  lenv* env     = frame->vars;
+  int   i       = 0;
   
   /* Record Argument Counts */
   int given = a->count;
-  int total = f->formals->count;
+  int total = formals->count;
   
   /* While arguments still remain to be processed */
   while (a->count) {
     
     /* If we've ran out of formal arguments to bind */
-    if (f->formals->count == 0) {
-      lval_del(a);
+    if (i == formals->count) {
+      lval_del(a); lval_del(frame);
       return lval_err("Function passed too many arguments. "
         "Got %i, Expected %i.", given, total); 
     }
     
-    /* Pop the first symbol from the formals */
-    lval* sym = lval_pop(f->formals, 0);
+    /* Take the next symbol from the formals */
+    lval* sym = formals->cell[i++];
     
     /* Special Case to deal with '&' */
-    if (strcmp(sym->sym, "&") == 0) {
+    if (sym->sym == lsym_rest) {
       
       /* Ensure '&' is followed by another symbol */
-      if (f->formals->count != 1) {
-        lval_del(a);
+      if (i != formals->count - 1) {
+        lval_del(a); lval_del(frame);
         return lval_err("Function format invalid. "
           "Symbol '&' not followed by single symbol.");
       }
       
       /* Next formal should be bound to remaining arguments */
-      lval* nsym = lval_pop(f->formals, 0);
-      lenv_put(f->env, nsym, builtin_list(e, a));
-      lval_del(sym); lval_del(nsym);
+      a = builtin_list(env, a);
+      lenv_put(env, formals->cell[i++], a);
       break;
     }
     
-    /* Pop the next argument from the list */
+    /* Pop the next argument from the list and bind it */
     lval* val = lval_pop(a, 0);
-    
-    /* Bind a copy into the function's environment */
-    lenv_put(f->env, sym, val);
-    
-    /* Delete symbol and value */
-    lval_del(sym); lval_del(val);
+    lenv_put(env, sym, val);
+    lval_del(val);
   }
   
   /* Argument list is now bound so can be cleaned up */
   lval_del(a);
   
   /* If '&' remains in formal list bind to empty list */
-  if (f->formals->count > 0 &&
-    strcmp(f->formals->cell[0]->sym, "&") == 0) {
+  if (i < formals->count && formals->cell[i]->sym == lsym_rest) {
     
     /* Check to ensure that & is not passed invalidly. */
-    if (f->formals->count != 2) {
+    if (i != formals->count - 2) {
+      lval_del(frame);
       return lval_err("Function format invalid. "
         "Symbol '&' not followed by single symbol.");
     }
     
-    /* Pop and delete '&' symbol */
-    lval_del(lval_pop(f->formals, 0));
-    
-    /* Pop next symbol and create empty list */
-    lval* sym = lval_pop(f->formals, 0);
     lval* val = lval_qexpr();
-    
-    /* Bind to environment and delete */
-    lenv_put(f->env, sym, val);
-    lval_del(sym); lval_del(val);
-  }
-  
-  /* If all formals have been bound evaluate */
-  if (f->formals->count == 0) {
-  
-    /* Set environment parent to evaluation environment */
-    f->env->par = e;
-    
-    /* Evaluate and return */
-    return builtin_eval(f->env, 
-      lval_add(lval_sexpr(), lval_copy(f->body)));
-  } else {
-    /* Otherwise return partially evaluated function */
-    return lval_copy(f);
-  }
-  
-}
-
-lval* lval_eval_sexpr(lenv* e, lval* v) {
-  
-  for (int i = 0; i < v->count; i++) {
-    v->cell[i] = lval_eval(e, v->cell[i]);
-  }
-  
-  for (int i = 0; i < v->count; i++) {
-    if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+    lenv_put(env, formals->cell[i + 1], val);
+    lval_del(val);
+    i += 2;
   }
   
-  if (v->count == 0) { return v; }  
-  if (v->count == 1) { return lval_eval(e, lval_take(v, 0)); }
-  
-  lval* f = lval_pop(v, 0);
-  if (f->type != LVAL_FUN) {
-    lval* err = lval_err(
-      "S-Expression starts with incorrect type. "
-      "Got %s, Expected %s.",
-      ltype_name(f->type), ltype_name(LVAL_FUN));
-    lval_del(f); lval_del(v);
-    return err;
-  }
+  if (i == formals->count) { return frame; }
   
-  lval* result = lval_call(e, f, v);
-  lval_del(f);
-  return result;
-}
-
-lval* lval_eval(lenv* e, lval* v) {
-  if (v->type == LVAL_SYM) {
-    lval* x = lenv_get(e, v);
-    lval_del(v);
-    return x;
-  }
-  if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
-  return v;
+  /* Partial application. Rather than copying f, wrap its body in a
+     lambda of the formals left, closing over the frame bound so far */
+  lval* rest = lval_slice(lval_ref(formals), i, formals->count - i);
+  return lval_lambda(frame, rest, lval_ref(f->body));
 }
 
 /* Reading */
@@ -159,6 +119,16 @@ lval* lval_read_num(mpc_ast_t* t)
   return errno != ERANGE ? lval_num(x) : lval_err("Invalid Number.");
 }
 
+lval* lval_read_dbl(mpc_ast_t* t) 
+{
+  errno = 0;
+  double x = strtod(t->contents, NULL);
+  
+  /* Too small only loses digits, too large has nothing to round to */
+  int big = errno == ERANGE && (x == HUGE_VAL || x == -HUGE_VAL);
+  return !big ? lval_dbl(x) : lval_err("Invalid Double.");
+}
+
 lval* lval_read_str(mpc_ast_t* t)
 {
   t->contents[strlen(t->contents)-1] = '\0';
@@ -173,6 +143,7 @@ lval* lval_read_str(mpc_ast_t* t)
 lval* lval_read(mpc_ast_t* t) 
 {  
   if (strstr(t->tag, "number")) { return lval_read_num(t); }
+  if (strstr(t->tag, "double")) { return lval_read_dbl(t); }
   if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
   if (strstr(t->tag, "string")) { return lval_read_str(t); }
   
@@ -194,11 +165,15 @@ lval* lval_read(mpc_ast_t* t)
   return x;
 }
 
-/* Main */
+/* Main. Left out with -DLISPY_NO_MAIN, for the programs in bench/ that
+   link the interpreter into their own */
+
+#ifndef LISPY_NO_MAIN
 
 int main(int argc, char** argv) {
   
   Number  = mpc_new("number");
+  Double  = mpc_new("double");
   String  = mpc_new("string");
   Comment = mpc_new("comment");
   Symbol  = mpc_new("symbol");
@@ -210,19 +185,23 @@ int main(int argc, char** argv) {
   mpca_lang(MPCA_LANG_DEFAULT,
     "                                                \
       number : /-?[0-9]+/ ;                          \
+      double : /-?[0-9]+((\\.[0-9]+)?[eE][-+]?[0-9]+|\\.[0-9]+)/ ; \
       string  : /\"(\\\\.|[^\"])*\"/ ;               \
       comment : /#[^\\r\\n]*/ ;                      \
       symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%]+/ ;   \
       sexpr   : '(' <expr>* ')' ;                    \
       qexpr   : '{' <expr>* '}' ;                    \
-      expr    : <number>  | <symbol> | <string>      \
-              | <comment> | <sexpr>  | <qexpr>;      \
+      expr    : <double>  | <number> | <symbol>      \
+              | <string>  | <comment> | <sexpr>     \
+              | <qexpr>;                             \
       lispy   : /^/ <expr>* /$/ ;                    \
     ",
-    Number, String, Comment, Symbol, Sexpr, Qexpr, Expr, Lispy);
+    Number, Double, String, Comment, Symbol, Sexpr, Qexpr, Expr, Lispy);
   
   
-  lenv* e = lenv_new();
+  lsym_init();
+  lval* global = lval_env(NULL);
+  lenv* e = global->vars;
   lenv_add_builtins(e);
   
   if(argc == 1)
@@ -257,14 +236,22 @@ int main(int argc, char** argv) {
     {
       lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
       lval* x = builtin_load(e, args);
-      if (x->type == LVAL_ERR) { lval_println(x); }
+      if (LVAL_TYPE(x) == LVAL_ERR) { lval_println(x); }
       lval_del(x);
     }
   }
   
-  lenv_del(e);
+  lval_del(global);
+  lgc_collect();
+  lgc_cleanup();
+  lvm_cleanup();
+  lalloc_cleanup();
+  lsym_cleanup();
   
-  mpc_cleanup(8, Number, String, Comment, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  mpc_cleanup(9, Number, Double, String, Comment, Symbol, Sexpr, Qexpr, Expr,
+    Lispy);
   
   return 0;
 }
+
+#endif
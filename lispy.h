@@ -1,6 +1,8 @@
 #ifndef LISPY_H
   #define LISPY_H
   
+  #include <stdint.h>
+  #include <limits.h>
   #include "mpc.h"
   
   struct lval;
@@ -9,10 +11,13 @@
   typedef struct lval lval;
   typedef struct lenv lenv;
   
-  enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_STR };
+  enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_STR,
+    LVAL_CELLS, LVAL_CODE, LVAL_ENV, LVAL_MAP, LVAL_PMAP, LVAL_NODE, LVAL_VEC,
+    LVAL_DBL };
   
   /* Parsers */
   mpc_parser_t* Number;
+  mpc_parser_t* Double;
   mpc_parser_t* String;
   mpc_parser_t* Comment;
   mpc_parser_t* Symbol;
@@ -23,71 +28,334 @@
   
   typedef lval*(*lbuiltin)(lenv*, lval*);
   
-  /* struct to represent all lispy value types */
+  /* Bytecode of a compiled lambda body, see lvm.c */
+  typedef struct lcode lcode;
+  
+  /* Hash table of a map, see lmap.c */
+  typedef struct lmap lmap;
+  
+  /* Small integers (fixnums) are not allocated. They are stored directly
+     in the lval pointer word with the low bit set, which can never be set
+     for a real lval since those are always at least 4 byte aligned.
+     Numbers outside the fixnum range fall back to a heap LVAL_NUM.
+     Always use LVAL_TYPE and LVAL_NUM_VAL to look at a value that may
+     be a number. */
+  #define LVAL_FIXNUM_MIN (LONG_MIN >> 1)
+  #define LVAL_FIXNUM_MAX (LONG_MAX >> 1)
+  
+  #define LVAL_IS_FIXNUM(v)  (((uintptr_t)(v)) & 1)
+  #define LVAL_FIXNUM(x)     ((lval*)(((uintptr_t)(x) << 1) | 1))
+  #define LVAL_FIXNUM_VAL(v) ((long)(((intptr_t)(v)) >> 1))
+  
+  /* Doubles (flonums) aren't allocated either, but stored in the words
+     whose low bits are 10. Their bits are rotated left by 3, so that the
+     tag lands on the top two bits of the exponent. Those can be worked
+     back out from the bit below them as long as the exponent is from
+     -255 to 255, which takes in nearly every double a program meets.
+     Zero has a word of its own, and other doubles fall back to a heap
+     LVAL_DBL. Use LVAL_DBL_VAL on a value that may be a double, and
+     LVAL_IS_IMMEDIATE to tell whether a value is an lval at all. */
+  #define LVAL_IS_FLONUM(v)    ((((uintptr_t)(v)) & 3) == 2)
+  #define LVAL_IS_IMMEDIATE(v) (((uintptr_t)(v)) & 3)
+  #define LVAL_FLONUM_ZERO     ((uint64_t)1 << 63 | 2)
+  
+  static inline double lval_flonum_val(const void* v)
+  {
+    uint64_t w = (uintptr_t)v;
+    union { uint64_t w; double d; } u = { 0 };
+    if (w != LVAL_FLONUM_ZERO) {
+      w = (w & ~(uint64_t)3) | (2 - (w >> 63));
+      u.w = w >> 3 | w << 61;
+    }
+    return u.d;
+  }
+  
+  #define LVAL_TYPE(v) \
+    (LVAL_IS_FIXNUM(v) ? LVAL_NUM : LVAL_IS_FLONUM(v) ? LVAL_DBL : (v)->type)
+  #define LVAL_NUM_VAL(v) \
+    (LVAL_IS_FIXNUM(v) ? LVAL_FIXNUM_VAL(v) : (v)->num)
+  #define LVAL_DBL_VAL(v) \
+    (LVAL_IS_FLONUM(v) ? lval_flonum_val(v) : (v)->dbl)
+  
+  /* A Number or Double as a double, for arithmetic mixing the two */
+  #define LVAL_AS_DBL(v) \
+    (LVAL_TYPE(v) == LVAL_DBL ? LVAL_DBL_VAL(v) : (double)LVAL_NUM_VAL(v))
+  
+  /* lval flags. MARK, SCAN and OLD are only used by the garbage collector,
+     SHARED marks an expression whose cells are in an LVAL_CELLS buffer
+     and HASHED one whose hash is cached, see lval_hash. PACKED marks an
+     expression, or cell buffer, holding nothing but fixnums. Its cells
+     are then a plain array of tagged integers, with no references to
+     count or children to trace */
+  enum { LVAL_BUILTIN = 1, LVAL_MARK = 2, LVAL_SCAN = 4, LVAL_OLD = 8,
+    LVAL_SHARED = 16, LVAL_HASHED = 32, LVAL_PACKED = 64 };
+  
+  #define LVAL_IS_PACKED(v) ((v)->flags & LVAL_PACKED)
+  
+  /* struct to represent all lispy value types. Each type only uses its
+     own members of the union, keeping an lval at 32 bytes so that two
+     of them fit in a cache line.
+     
+     Values are reference counted and shared rather than copied. A value
+     with more than one reference must be treated as immutable, so code
+     that changes a value in place first calls lval_unshare on it. The
+     same goes for the cell buffers behind expressions, so copying an
+     expression, or taking its head or tail, shares the elements */
   struct lval 
   {
-    int type;
-    
-    /* Identity */
-    long num;
-    char *err;
-    char *sym;
-    char *str; 
+    unsigned char type;
+    unsigned char flags;
+    unsigned int  refs;
     
-    /* Function */
-    lbuiltin builtin;
-    lenv* env;
-    lval* formals;
-    lval* body;
-    
-    /* Expression */
-    int count;
-    lval** cell;
+    union
+    {
+      /* Number (only when too large for a fixnum) */
+      long num;
+      
+      /* Double (only when out of the flonum range) */
+      double dbl;
+      
+      /* Error, String */
+      char* err;
+      char* str;
+      
+      /* Symbol */
+      char* sym;
+      
+      /* Builtin Function */
+      lbuiltin builtin;
+      
+      /* Lambda Function. env is the LVAL_ENV it was made in, or that
+         holds the arguments bound so far by a partial application, and
+         body is the compiled LVAL_CODE */
+      struct {
+        lval* env;
+        lval* formals;
+        lval* body;
+      };
+      
+      /* Expression. Its count elements start at cell. Normally that is
+         start slots into an array of its own with room for cap, so that
+         elements can be popped from the front and appended at the back
+         in O(1). Once the expression is copied the array moves into a
+         cells buffer shared by both (LVAL_SHARED) */
+      struct {
+        lval** cell;
+        union {
+          struct { int start; int cap; };
+          lval* cells;
+        };
+        int count;
+        uint32_t hash;
+      };
+      
+      /* Cell buffer, never seen by lispy code. Holds a reference to each
+         of items[lo..used), room for size */
+      struct {
+        lval** items;
+        int    lo;
+        int    used;
+        int    size;
+      };
+      
+      /* Compiled code, never seen by lispy code. Prints and compares as
+         the Q-Expression it was compiled from */
+      struct {
+        lval*  src;
+        lcode* code;
+      };
+      
+      /* Map from keys to values, compared with lval_eq. Changed in place
+         only when not shared, like an expression */
+      lmap* map;
+      
+      /* Persistent map of nkeys entries, never changed once made. root
+         is the LVAL_NODE at the top of its trie, or NULL when empty */
+      struct {
+        lval* root;
+        int   nkeys;
+      };
+      
+      /* Trie node of a persistent map, never seen by lispy code. Holds
+         nkids slots of two values in kids, one for each bit set in
+         bitmap. See lhamt.c */
+      struct {
+        lval**   kids;
+        uint32_t bitmap;
+        int      nkids;
+      };
+      
+      /* Vector of len numbers packed in an array, int64_t or double as
+         elem says. Never changed once made, see lvec.c */
+      struct {
+        union {
+          int64_t* ints;
+          double*  dbls;
+        };
+        int len;
+        int elem;
+      };
+      
+      /* Environment, never seen by lispy code. Call frames and the
+         lambdas closing over them share it. Holds on to the LVAL_ENV of
+         its parent environment in outer */
+      struct {
+        lenv* vars;
+        lval* outer;
+      };
+    };
   };
   
-  /* struct to represent lispy environment */
+  #define LVAL_IS_BUILTIN(v) ((v)->flags & LVAL_BUILTIN)
+  
+  /* struct to represent lispy environment. Symbol names are interned,
+     see lsym_intern. Small environments keep their symbols and values in
+     parallel arrays, large ones in the slots of a hash table (cap > 0).
+     Every environment belongs to the LVAL_ENV self */
+  typedef struct lslot { char* sym; lval* val; } lslot;
+  
   struct lenv 
   {
     lenv* par;
+    lval* self;
     int count;
-    char** syms;
-    lval** vals;
+    int cap;
+    
+    union
+    {
+      struct {
+        char** syms;
+        lval** vals;
+      };
+      lslot* slots;
+    };
   };
+  
+  /* Walk the values of an environment in either layout. Unused hash
+     table slots are NULL */
+  #define LENV_SIZE(e)   ((e)->cap ? (e)->cap : (e)->count)
+  #define LENV_VAL(e, i) ((e)->cap ? (e)->slots[i].val : (e)->vals[i])
 
   /* function prototypes */
   
   lval* lval_read(mpc_ast_t* t);
   
+  /* allocator */
+  lval* lval_alloc(void);
+  void  lval_free(lval* v);
+  lenv* lenv_alloc(void);
+  void  lenv_free(lenv* e);
+  void  lval_each(void (*fn)(lval*));
+  void  lval_each_young(void (*fn)(lval*));
+  void  lval_tenure(void);
+  unsigned long lalloc_count(void);
+  size_t lalloc_live_bytes(void);
+  void  lalloc_print(void);
+  void  lalloc_cleanup(void);
+  
+  /* hash tables */
+  lmap* lmap_new(void);
+  lmap* lmap_copy(lmap* m);
+  void  lmap_free(lmap* m);
+  int   lmap_count(lmap* m);
+  int   lmap_next(lmap* m, int i);
+  lval* lmap_key(lmap* m, int i);
+  lval* lmap_val(lmap* m, int i);
+  lval* lmap_get(lmap* m, lval* k);
+  void  lmap_put(lmap* m, lval* k, lval* v);
+  int   lmap_remove(lmap* m, lval* k);
+  
+  /* vector kernels */
+  enum { LVEC_INT, LVEC_DBL };
+  enum { LVEC_ADD, LVEC_SUB, LVEC_MUL, LVEC_DIV };
+  enum { LVEC_EQ, LVEC_LT, LVEC_GT, LVEC_LE, LVEC_GE };
+  
+  /* Errors from arithmetic on integers, by builtins and vector kernels */
+  #define LOP_OVERFLOW "Integer Overflow."
+  #define LOP_DIV_ZERO "Division By Zero."
+  
+  char*   lvec_arith_int(int op, int64_t* r, int64_t* x, int xs,
+    int64_t* y, int ys, int n);
+  void    lvec_arith_dbl(int op, double* r, double* x, int xs,
+    double* y, int ys, int n);
+  void    lvec_compare_int(int op, int64_t* r, int64_t* x, int xs,
+    int64_t* y, int ys, int n);
+  void    lvec_compare_dbl(int op, int64_t* r, double* x, int xs,
+    double* y, int ys, int n);
+  char*   lvec_sum_int(int64_t* x, int n, int64_t* out);
+  double  lvec_sum_dbl(double* x, int n);
+  char*   lvec_dot_int(int64_t* x, int64_t* y, int n, int64_t* out);
+  double  lvec_dot_dbl(double* x, double* y, int n);
+  int64_t lvec_extreme_int(int max, int64_t* x, int n);
+  double  lvec_extreme_dbl(int max, double* x, int n);
+  char*   lvec_scan_int(int64_t* r, int64_t* x, int n);
+  void    lvec_scan_dbl(double* r, double* x, int n);
+  int     lvec_set(char* knob, long value);
+  void    lvec_print(void);
+  
+  /* persistent map tries */
+  lval*  lhamt_get(lval* root, lval* k);
+  lval*  lhamt_assoc(lval* root, lval* k, lval* v, int* added);
+  lval*  lhamt_dissoc(lval* root, lval* k, int* removed);
+  lval** lhamt_entries(lval* root, int count);
+  
+  /* symbol intern table */
+  extern char* lsym_rest;
+  extern char* lsym_if;
+  char* lsym_intern(char* s);
+  uint32_t lsym_hash(char* s);
+  void  lsym_init(void);
+  void  lsym_cleanup(void);
+  
+  /* garbage collector */
+  size_t lgc_collect(void);
+  size_t lgc_minor(void);
+  void  lgc_poll(void);
+  int   lgc_set(char* knob, long value);
+  void  lgc_print(void);
+  void  lgc_cleanup(void);
+  
   /* lval functions */
   lval* lval_num(long x);
+  lval* lval_dbl(double x);
   lval* lval_err(char* fmt, ...);
   lval* lval_sym(char* s);
   lval* lval_str(char* s);
   lval* lval_builtin(lbuiltin func);
-  lval* lval_lambda(lval* formals, lval* body);
+  lval* lval_lambda(lval* env, lval* formals, lval* body);
+  lval* lval_env(lval* par);
+  lval* lval_map(void);
+  lval* lval_pmap(lval* root, int nkeys);
+  lval* lval_vec(int elem, int len);
   lval* lval_sexpr(void);
   lval* lval_qexpr(void);
+  lval* lval_sexpr_of(lval** x, int n);
   void  lval_del(lval* v);
+  lval* lval_ref(lval* v);
   lval* lval_copy(lval* v);
+  lval* lval_unshare(lval* v);
   lval* lval_add(lval* v, lval* x);
   lval* lval_join(lval* x, lval* y);
   lval* lval_pop(lval* v, int i);
+  lval* lval_slice(lval* v, int i, int n);
   lval* lval_take(lval* v, int i);
+  uint32_t lval_hash(lval* v);
   
   /* lval print */
   void  lval_print(lval *v);
   void  lval_println(lval *v);
   void  lval_print_str(lval *v);
-  void  lval_print_expr(lval* v, char open, char close);
   
   /* lenv functions */
-  lenv* lenv_new(void);
-  lenv* lenv_copy(lenv* e);
   void  lenv_del(lenv* e);
   lval* lenv_get(lenv* e, lval* v);
+  lval* lenv_get_from(lenv* e, lval* v, lenv** found);
   void  lenv_put(lenv* e, lval* k, lval* v);
   void  lenv_def(lenv* e, lval* k, lval* v);
   
+  /* Bumped whenever 'def' or '=' changes a binding, see lvm.c */
+  extern unsigned long lenv_version;
+  
   char* ltype_name(int t);
   
   /* builtin operations */
@@ -98,6 +366,7 @@
   lval* builtin_head(lenv* e, lval* a);
   lval* builtin_tail(lenv* e, lval* a);
   lval* builtin_eval(lenv* e, lval* a);
+  lval* builtin_eval_expr(lval* a);
   lval* builtin_join(lenv* e, lval* a);
   lval* builtin_def (lenv* e, lval* a);
   lval* builtin_put (lenv* e, lval* a);
@@ -116,16 +385,56 @@
   lval* builtin_le(lenv* e, lval* a);
   lval* builtin_eq(lenv* e, lval* a);
   lval* builtin_ne(lenv* e, lval* a);
+  lval* builtin_hash(lenv* e, lval* a);
   lval* builtin_if(lenv* e, lval* a);
+  lval* builtin_if_expr(lval* a);
+  
+  /* Maps */
+  lval* builtin_map(lenv* e, lval* a);
+  lval* builtin_insert(lenv* e, lval* a);
+  lval* builtin_lookup(lenv* e, lval* a);
+  lval* builtin_delete(lenv* e, lval* a);
+  lval* builtin_size(lenv* e, lval* a);
+  lval* builtin_keys(lenv* e, lval* a);
+  lval* builtin_pairs(lenv* e, lval* a);
+  lval* builtin_pmap(lenv* e, lval* a);
+  lval* builtin_assoc(lenv* e, lval* a);
+  lval* builtin_dissoc(lenv* e, lval* a);
+  
+  /* Vectors */
+  lval* builtin_vec(lenv* e, lval* a);
+  lval* builtin_fvec(lenv* e, lval* a);
+  lval* builtin_vrange(lenv* e, lval* a);
+  lval* builtin_vlist(lenv* e, lval* a);
+  lval* builtin_vlen(lenv* e, lval* a);
+  lval* builtin_vref(lenv* e, lval* a);
+  lval* builtin_vadd(lenv* e, lval* a);
+  lval* builtin_vsub(lenv* e, lval* a);
+  lval* builtin_vmul(lenv* e, lval* a);
+  lval* builtin_vdiv(lenv* e, lval* a);
+  lval* builtin_veq(lenv* e, lval* a);
+  lval* builtin_vlt(lenv* e, lval* a);
+  lval* builtin_vgt(lenv* e, lval* a);
+  lval* builtin_vle(lenv* e, lval* a);
+  lval* builtin_vge(lenv* e, lval* a);
+  lval* builtin_vsum(lenv* e, lval* a);
+  lval* builtin_vmin(lenv* e, lval* a);
+  lval* builtin_vmax(lenv* e, lval* a);
+  lval* builtin_vdot(lenv* e, lval* a);
+  lval* builtin_vscan(lenv* e, lval* a);
   
   /* String */
   lval* builtin_load(lenv* e, lval* a);
   lval* builtin_print(lenv* e, lval* a);
   lval* builtin_error(lenv* e, lval* a);
   
-  lval* builtin_ord(lenv* e, lval* a, char* op);
-  lval* builtin_cmp(lenv* e, lval* a, char* op);
-  lval* builtin_op (lenv* e, lval* a, char* op);
+  /* Runtime */
+  lval* builtin_stats(lenv* e, lval* a);
+  lval* builtin_gc(lenv* e, lval* a);
+  lval* builtin_limit(lenv* e, lval* a);
+  lval* builtin_jit(lenv* e, lval* a);
+  lval* builtin_simd(lenv* e, lval* a);
+  
   lval* builtin_var(lenv* e, lval* a, char* func);
   
   void lenv_add_builtins(lenv* e);
@@ -134,15 +443,52 @@
   
   /* Evaluation functions */
   lval* lval_eval(lenv* e, lval* v);
+  lval* lval_call(lenv* e, lval* f, lval* a);
+  lval* lval_bind(lval* f, lval* a);
+  
+  /* bytecode compiler and evaluator. Code nested deeper than
+     LVM_NEST_MAX in a lambda body is walked rather than compiled, which
+     keeps lvm_compile from recursing too deep */
+  #define LVM_NEST_MAX 64
+  
+  lval* lvm_compile(lval* body, lval* formals);
+  int   lvm_slot(lval* formals, char* sym);
+  lval* lvm_formals(lcode* c);
+  int   lvm_ncaches(lcode* c);
+  lval* lvm_cache(lcode* c, int i);
+  lval* lvm_run(lval* f, lval* env);
+  void  lvm_free(lcode* c);
+  int   lvm_set(char* knob, long value);
+  void  lvm_print(void);
+  void  lvm_print_cache(void);
+  void  lvm_cleanup(void);
+  
+  /* native code compiler, see ljit.c */
+  typedef struct ljit ljit;
+  
+  int   ljit_hot(unsigned int* calls);
+  ljit* ljit_compile(lval* f);
+  lval* ljit_run(ljit* j, lval* f, lval* a, long budget);
+  void  ljit_free(ljit* j);
+  int   ljit_set(char* knob, long value);
+  void  ljit_print(void);
   
   #define LASSERT(args, cond, fmt, ...) \
     if (!(cond)) { lval* err = lval_err(fmt, ##__VA_ARGS__); lval_del(args); return err; }
   
   #define LASSERT_TYPE(func, args, index, expect) \
-    LASSERT(args, args->cell[index]->type == expect, \
+    LASSERT(args, LVAL_TYPE(args->cell[index]) == expect, \
       "Function '%s' passed incorrect type for argument %i. " \
       "Got %s, Expected %s.", \
-      func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+      func, index, ltype_name(LVAL_TYPE(args->cell[index])), ltype_name(expect))
+  
+  #define LASSERT_NUMERIC(func, args, index) \
+    LASSERT(args, LVAL_TYPE(args->cell[index]) == LVAL_NUM || \
+      LVAL_TYPE(args->cell[index]) == LVAL_DBL, \
+      "Function '%s' passed incorrect type for argument %i. " \
+      "Got %s, Expected %s or %s.", \
+      func, index, ltype_name(LVAL_TYPE(args->cell[index])), \
+      ltype_name(LVAL_NUM), ltype_name(LVAL_DBL))
   
   #define LASSERT_NUM(func, args, num) \
     LASSERT(args, args->count == num, \
@@ -0,0 +1,557 @@
+#define _DEFAULT_SOURCE
+#include "lispy.h"
+
+/* Native code compiler.
+
+   A lambda called often enough is compiled to x86-64 machine code,
+   if its body only does fixnum arithmetic and comparisons on its
+   formals and literal numbers, takes branches with 'if' and calls
+   itself. Everything else stays with the bytecode in lvm.c.
+
+   Values are kept tagged the same way as fixnums, so a formal is
+   used as it is, a + b is a + b - 1 and comparing two fixnums
+   compares their tagged words. A result leaving the fixnum range
+   shows up as the overflow flag. A call to itself in tail position
+   becomes a jump back to the start of the body, any other call to
+   itself a native call.
+
+   None of that has side effects, which makes falling back to the
+   interpreter (deoptimizing) simple. Whenever something turns up that
+   the code can't deal with, like a result that needs a heap number or
+   nesting deeper than allowed, it throws away its native frames and
+   the call runs again in the interpreter from the start, which gets
+   to the same place and carries on from there.
+
+   The code assumes the operators and the name it calls itself by are
+   still bound globally to what they were when it was compiled. That
+   is checked before entering it, and the answer is kept until a 'def'
+   or '=' bumps lenv_version, see lvm.c. Nothing can rebind them while
+   the native code runs.
+
+   Only built on x86-64 Linux, and not at all with -DLISPY_NO_JIT,
+   elsewhere lambdas are never compiled. */
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(LISPY_NO_JIT)
+  #define LJIT_NATIVE
+  #include <sys/mman.h>
+  #include <unistd.h>
+#endif
+
+/* Most native calls nested at once, well within the C stack */
+#define LJIT_DEPTH 10000
+
+/* Deoptimizations after which a lambda goes back to the interpreter */
+#define LJIT_BAILS 8
+
+/* Native entry, called with the arguments and the calls it may nest.
+   Returns the tagged result, or NULL to run the call in the interpreter */
+typedef lval* (*lnative)(lval** args, long budget);
+
+/* Something the code assumes to be bound globally. sym to the builtin
+   fn, or to a lambda running the same body if fn is NULL */
+typedef struct lguard
+{
+  lval*    sym;
+  lbuiltin fn;
+} lguard;
+
+struct ljit
+{
+  lnative fn;
+  void*   mem;
+  size_t  size;
+  lval*   body;    /* LVAL_CODE it was compiled from */
+  lval*   formals; /* the formals of that code, which holds on to them */
+  int     arity;
+
+  lguard* guards;
+  int     nguards;
+  unsigned long version;
+  int     holds;
+  int     bails;
+};
+
+static struct
+{
+  /* Knobs */
+  unsigned long threshold;  /* calls before compiling, 0 to disable */
+
+  /* Stats */
+  unsigned long compiled;
+  unsigned long rejected;
+  unsigned long bytes;
+  unsigned long calls;
+  unsigned long deopts;
+} jit = { .threshold = 1000 };
+
+int ljit_hot(unsigned int* calls)
+{
+  if (!jit.threshold || *calls >= jit.threshold) { return 0; }
+  return ++*calls == jit.threshold;
+}
+
+#ifdef LJIT_NATIVE
+
+/* #region Assembler */
+
+enum { LJ_ADD, LJ_SUB, LJ_MUL, LJ_GT, LJ_LT, LJ_GE, LJ_LE, LJ_EQ, LJ_NE };
+
+static const struct { char* name; lbuiltin fn; int op; } ljit_ops[] = {
+  { "+",  builtin_add, LJ_ADD }, { "-",  builtin_sub, LJ_SUB },
+  { "*",  builtin_mul, LJ_MUL },
+  { ">",  builtin_gt,  LJ_GT  }, { "<",  builtin_lt,  LJ_LT  },
+  { ">=", builtin_ge,  LJ_GE  }, { "<=", builtin_le,  LJ_LE  },
+  { "==", builtin_eq,  LJ_EQ  }, { "!=", builtin_ne,  LJ_NE  },
+};
+
+/* setcc for each comparison, after cmp rax, rcx */
+static const unsigned char ljit_setcc[] = {
+  [LJ_GT] = 0x9F, [LJ_LT] = 0x9C, [LJ_GE] = 0x9D, [LJ_LE] = 0x9E,
+  [LJ_EQ] = 0x94, [LJ_NE] = 0x95
+};
+
+/* Code being compiled. The value of every expression ends up in rax,
+   with temporaries pushed on the machine stack */
+typedef struct lasm
+{
+  unsigned char* buf;
+  int  len;
+  int  cap;
+
+  /* Offsets of the rel32 jumps to the bail out code */
+  int* bails;
+  int  nbails;
+  int  bcap;
+
+  int  inner;   /* start of the function the body is in */
+  int  start;   /* start of the body, where tail calls jump to */
+  int  arity;
+  lval* formals;
+  lval* self;   /* name the lambda calls itself by, once seen */
+  int  ok;
+
+  lguard* guards;
+  int     nguards;
+  int     gcap;
+} lasm;
+
+static void lasm_bytes(lasm* s, const void* b, int n)
+{
+  if (s->len + n > s->cap)
+  {
+    while (s->len + n > s->cap) { s->cap = s->cap ? s->cap * 2 : 256; }
+    s->buf = realloc(s->buf, s->cap);
+  }
+  memcpy(s->buf + s->len, b, n);
+  s->len += n;
+}
+
+#define LASM(s, ...) do { \
+    const unsigned char b_[] = { __VA_ARGS__ }; \
+    lasm_bytes(s, b_, sizeof(b_)); \
+  } while (0)
+
+static void lasm_i32(lasm* s, int32_t x) { lasm_bytes(s, &x, 4); }
+static void lasm_i64(lasm* s, int64_t x) { lasm_bytes(s, &x, 8); }
+
+/* Point the rel32 ending at offset at to target */
+static void lasm_patch(lasm* s, int at, int target)
+{
+  int32_t rel = target - (at + 4);
+  memcpy(s->buf + at, &rel, 4);
+}
+
+/* Emit a jump (0x0F op, or op alone if one byte) with a rel32 still to
+   be patched, returning where it is */
+static int lasm_jump(lasm* s, int op)
+{
+  if (op >= 0x80 && op <= 0x8F) { LASM(s, 0x0F, op); } else { LASM(s, op); }
+  lasm_i32(s, 0);
+  return s->len - 4;
+}
+
+static void lasm_bail(lasm* s, int op)
+{
+  if (s->nbails == s->bcap)
+  {
+    s->bcap  = s->bcap ? s->bcap * 2 : 16;
+    s->bails = realloc(s->bails, sizeof(int) * s->bcap);
+  }
+  s->bails[s->nbails++] = lasm_jump(s, op);
+}
+
+static void lasm_guard(lasm* s, lval* sym, lbuiltin fn)
+{
+  for (int i = 0; i < s->nguards; i++) {
+    if (s->guards[i].sym->sym == sym->sym && s->guards[i].fn == fn) { return; }
+  }
+  if (s->nguards == s->gcap)
+  {
+    s->gcap   = s->gcap ? s->gcap * 2 : 8;
+    s->guards = realloc(s->guards, sizeof(lguard) * s->gcap);
+  }
+  s->guards[s->nguards].sym = sym;
+  s->guards[s->nguards].fn  = fn;
+  s->nguards++;
+}
+
+/* Displacement of formal i from rbp. The caller pushes them in order */
+static int32_t lasm_formal(lasm* s, int i) { return 16 + 8 * (s->arity - 1 - i); }
+
+/* #endregion Assembler */
+
+/* #region Compiler */
+
+static void ljit_cells(lasm* s, lval* v, int tail, int nest);
+
+/* Code leaving the value of the cell v in rax */
+static void ljit_value(lasm* s, lval* v, int nest)
+{
+  if (!s->ok) { return; }
+
+  if (LVAL_IS_FIXNUM(v)) {
+    LASM(s, 0x48, 0xB8);                     /* mov rax, imm64 */
+    lasm_i64(s, (int64_t)(uintptr_t)v);
+    return;
+  }
+
+  switch (LVAL_TYPE(v)) {
+    case LVAL_SYM: {
+      int slot = lvm_slot(s->formals, v->sym);
+      if (slot < 0 || slot >= s->arity) { break; }
+      LASM(s, 0x48, 0x8B, 0x85);             /* mov rax, [rbp + d] */
+      lasm_i32(s, lasm_formal(s, slot));
+      return;
+    }
+    case LVAL_SEXPR:
+      ljit_cells(s, v, 0, nest + 1);
+      return;
+  }
+  s->ok = 0;
+}
+
+static void ljit_op(lasm* s, lval* v, int op, int nest)
+{
+  int n = v->count - 1;
+  if (n < 2 || (op >= LJ_GT && n != 2)) {
+    s->ok = 0;
+    return;
+  }
+
+  ljit_value(s, v->cell[1], nest);
+  for (int i = 2; i <= n; i++) {
+    LASM(s, 0x50);                           /* push rax */
+    ljit_value(s, v->cell[i], nest);
+    LASM(s, 0x48, 0x89, 0xC1);               /* mov rcx, rax */
+    LASM(s, 0x58);                           /* pop rax */
+
+    switch (op) {
+      case LJ_ADD:
+        LASM(s, 0x48, 0x83, 0xE9, 0x01);     /* sub rcx, 1 */
+        LASM(s, 0x48, 0x01, 0xC8);           /* add rax, rcx */
+        lasm_bail(s, 0x80);                  /* jo */
+        break;
+      case LJ_SUB:
+        LASM(s, 0x48, 0x83, 0xE9, 0x01);     /* sub rcx, 1 */
+        LASM(s, 0x48, 0x29, 0xC8);           /* sub rax, rcx */
+        lasm_bail(s, 0x80);                  /* jo */
+        break;
+      case LJ_MUL:
+        LASM(s, 0x48, 0xD1, 0xF8);           /* sar rax, 1 */
+        LASM(s, 0x48, 0x83, 0xE9, 0x01);     /* sub rcx, 1 */
+        LASM(s, 0x48, 0x0F, 0xAF, 0xC1);     /* imul rax, rcx */
+        lasm_bail(s, 0x80);                  /* jo */
+        LASM(s, 0x48, 0x83, 0xC8, 0x01);     /* or rax, 1 */
+        break;
+      default:
+        LASM(s, 0x48, 0x39, 0xC8);           /* cmp rax, rcx */
+        LASM(s, 0x0F, ljit_setcc[op], 0xC0); /* setcc al */
+        LASM(s, 0x0F, 0xB6, 0xC0);           /* movzx eax, al */
+        LASM(s, 0x48, 0x8D, 0x44, 0x00, 0x01); /* lea rax, [rax + rax + 1] */
+        break;
+    }
+  }
+}
+
+static void ljit_if(lasm* s, lval* v, int tail, int nest)
+{
+  if (v->count != 4
+    || LVAL_TYPE(v->cell[2]) != LVAL_QEXPR
+    || LVAL_TYPE(v->cell[3]) != LVAL_QEXPR)
+  {
+    s->ok = 0;
+    return;
+  }
+
+  ljit_value(s, v->cell[1], nest);
+  LASM(s, 0x48, 0x83, 0xF8, 0x01);           /* cmp rax, fixnum 0 */
+  int no = lasm_jump(s, 0x84);               /* je */
+  ljit_cells(s, v->cell[2], tail, nest + 1);
+  int end = lasm_jump(s, 0xE9);              /* jmp */
+  lasm_patch(s, no, s->len);
+  ljit_cells(s, v->cell[3], tail, nest + 1);
+  lasm_patch(s, end, s->len);
+}
+
+static void ljit_call(lasm* s, lval* v, int tail, int nest)
+{
+  if (v->count - 1 != s->arity) {
+    s->ok = 0;
+    return;
+  }
+
+  for (int i = 1; i < v->count; i++) {
+    ljit_value(s, v->cell[i], nest);
+    LASM(s, 0x50);                           /* push rax */
+  }
+
+  if (tail) {
+    for (int i = s->arity - 1; i >= 0; i--) {
+      LASM(s, 0x58);                         /* pop rax */
+      LASM(s, 0x48, 0x89, 0x85);             /* mov [rbp + d], rax */
+      lasm_i32(s, lasm_formal(s, i));
+    }
+    lasm_patch(s, lasm_jump(s, 0xE9), s->start);
+    return;
+  }
+
+  lasm_patch(s, lasm_jump(s, 0xE8), s->inner); /* call */
+  LASM(s, 0x48, 0x81, 0xC4);                 /* add rsp, imm32 */
+  lasm_i32(s, 8 * s->arity);
+}
+
+/* Code leaving the value of the cells of v evaluated as an S-Expression
+   in rax, see lvm_sexpr_cells */
+static void ljit_cells(lasm* s, lval* v, int tail, int nest)
+{
+  if (!s->ok) { return; }
+  if (v->count == 0 || nest > LVM_NEST_MAX) {
+    s->ok = 0;
+    return;
+  }
+
+  /* Evaluating a number again leaves it as it is */
+  if (v->count == 1) {
+    ljit_value(s, v->cell[0], nest);
+    return;
+  }
+
+  lval* head = v->cell[0];
+  if (LVAL_TYPE(head) != LVAL_SYM || lvm_slot(s->formals, head->sym) >= 0) {
+    s->ok = 0;
+    return;
+  }
+
+  if (head->sym == lsym_if) {
+    lasm_guard(s, head, builtin_if);
+    ljit_if(s, v, tail, nest);
+    return;
+  }
+
+  for (int i = 0; i < (int)(sizeof(ljit_ops) / sizeof(ljit_ops[0])); i++) {
+    if (strcmp(head->sym, ljit_ops[i].name) == 0) {
+      lasm_guard(s, head, ljit_ops[i].fn);
+      ljit_op(s, v, ljit_ops[i].op, nest);
+      return;
+    }
+  }
+
+  /* Anything else has to be the lambda itself */
+  if (s->self && s->self->sym != head->sym) {
+    s->ok = 0;
+    return;
+  }
+  s->self = head;
+  lasm_guard(s, head, NULL);
+  ljit_call(s, v, tail, nest);
+}
+
+/* Formals without '&' or a name given twice, so that formal i is the
+   slot i lvm_slot gives it */
+static int ljit_formals(lval* formals)
+{
+  for (int i = 0; i < formals->count; i++) {
+    if (formals->cell[i]->sym == lsym_rest) { return 0; }
+    for (int j = 0; j < i; j++) {
+      if (formals->cell[j]->sym == formals->cell[i]->sym) { return 0; }
+    }
+  }
+  return 1;
+}
+
+ljit* ljit_compile(lval* f)
+{
+  lasm s = { .arity = f->formals->count, .formals = f->formals,
+             .ok = ljit_formals(f->formals) };
+
+  /* Entry from C, lnative. Keeps the stack pointer in r15 to bail out
+     from any depth, and the calls left to nest in r14 */
+  LASM(&s, 0x55);                            /* push rbp */
+  LASM(&s, 0x48, 0x89, 0xE5);                /* mov rbp, rsp */
+  LASM(&s, 0x41, 0x56);                      /* push r14 */
+  LASM(&s, 0x41, 0x57);                      /* push r15 */
+  LASM(&s, 0x49, 0x89, 0xE7);                /* mov r15, rsp */
+  LASM(&s, 0x49, 0x89, 0xF6);                /* mov r14, rsi */
+  for (int i = 0; i < s.arity; i++) {
+    LASM(&s, 0xFF, 0xB7);                    /* push [rdi + 8i] */
+    lasm_i32(&s, 8 * i);
+  }
+  int call = lasm_jump(&s, 0xE8);            /* call inner */
+  int bail = s.len;
+  LASM(&s, 0x4C, 0x89, 0xFC);                /* mov rsp, r15 */
+  LASM(&s, 0x41, 0x5F);                      /* pop r15 */
+  LASM(&s, 0x41, 0x5E);                      /* pop r14 */
+  LASM(&s, 0x5D);                            /* pop rbp */
+  LASM(&s, 0xC3);                            /* ret */
+  int fail = s.len;
+  LASM(&s, 0x31, 0xC0);                      /* xor eax, eax */
+  lasm_patch(&s, lasm_jump(&s, 0xE9), bail);
+
+  /* The body, as a function of its own taking the formals on the stack */
+  s.inner = s.len;
+  lasm_patch(&s, call, s.inner);
+  LASM(&s, 0x49, 0x83, 0xEE, 0x01);          /* sub r14, 1 */
+  lasm_bail(&s, 0x84);                       /* je */
+  LASM(&s, 0x55);                            /* push rbp */
+  LASM(&s, 0x48, 0x89, 0xE5);                /* mov rbp, rsp */
+  s.start = s.len;
+  ljit_cells(&s, f->body->src, 1, 0);
+  LASM(&s, 0x48, 0x89, 0xEC);                /* mov rsp, rbp */
+  LASM(&s, 0x5D);                            /* pop rbp */
+  LASM(&s, 0x49, 0x83, 0xC6, 0x01);          /* add r14, 1 */
+  LASM(&s, 0xC3);                            /* ret */
+
+  for (int i = 0; i < s.nbails; i++) { lasm_patch(&s, s.bails[i], fail); }
+  free(s.bails);
+
+  void* mem = MAP_FAILED;
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = (s.len + page - 1) / page * page;
+  if (s.ok) {
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (mem != MAP_FAILED) {
+    memcpy(mem, s.buf, s.len);
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+      munmap(mem, size);
+      mem = MAP_FAILED;
+    }
+  }
+  free(s.buf);
+
+  if (mem == MAP_FAILED) {
+    free(s.guards);
+    jit.rejected++;
+    return NULL;
+  }
+
+  ljit* j = calloc(1, sizeof(ljit));
+  memcpy(&j->fn, &mem, sizeof(j->fn));
+  j->mem     = mem;
+  j->size    = size;
+  j->body    = f->body;
+  j->formals = f->formals;
+  j->arity   = s.arity;
+  j->guards  = s.guards;
+  j->nguards = s.nguards;
+
+  jit.compiled++;
+  jit.bytes += s.len;
+  return j;
+}
+
+void ljit_free(ljit* j)
+{
+  munmap(j->mem, j->size);
+  free(j->guards);
+  free(j);
+}
+
+/* #endregion Compiler */
+
+/* Whether the guards of j hold, looking them up from the environment
+   f closes over */
+static int ljit_holds(ljit* j, lval* f)
+{
+  lenv* e = f->env->vars;
+  for (int i = 0; i < j->nguards; i++) {
+    lenv* found;
+    lval* x  = lenv_get_from(e, j->guards[i].sym, &found);
+    int   ok = found && !found->par && LVAL_TYPE(x) == LVAL_FUN;
+    if (ok && j->guards[i].fn) {
+      ok = LVAL_IS_BUILTIN(x) && x->builtin == j->guards[i].fn;
+    } else if (ok) {
+      ok = !LVAL_IS_BUILTIN(x) && x->body == j->body
+        && x->formals == j->formals;
+    }
+    lval_del(x);
+    if (!ok) { return 0; }
+  }
+  return 1;
+}
+
+lval* ljit_run(ljit* j, lval* f, lval* a, long budget)
+{
+  if (j->bails >= LJIT_BAILS || a->count != j->arity) { return NULL; }
+  for (int i = 0; i < a->count; i++) {
+    if (!LVAL_IS_FIXNUM(a->cell[i])) { return NULL; }
+  }
+
+  if (j->version != lenv_version) {
+    j->holds   = ljit_holds(j, f);
+    j->version = lenv_version;
+  }
+  if (!j->holds) { return NULL; }
+
+  if (budget > LJIT_DEPTH) { budget = LJIT_DEPTH; }
+  if (budget <= 0) { return NULL; }
+
+  jit.calls++;
+  lval* r = j->fn(a->cell, budget + 1);
+  if (!r) {
+    jit.deopts++;
+    j->bails++;
+    return NULL;
+  }
+  lval_del(a);
+  return r;
+}
+
+#else
+
+ljit* ljit_compile(lval* f)
+{
+  (void)f;
+  jit.rejected++;
+  return NULL;
+}
+
+void ljit_free(ljit* j) { (void)j; }
+
+lval* ljit_run(ljit* j, lval* f, lval* a, long budget)
+{
+  (void)j; (void)f; (void)a; (void)budget;
+  return NULL;
+}
+
+#endif
+
+int ljit_set(char* knob, long value)
+{
+  if (value < 0) { return 0; }
+
+  if (strcmp(knob, "threshold") == 0) {
+    jit.threshold = value;
+    return 1;
+  }
+  return 0;
+}
+
+void ljit_print(void)
+{
+  printf("jit : %lu lambdas compiled (%lu bytes), %lu rejected, "
+    "%lu native calls, %lu deoptimized, threshold %lu calls\n",
+    jit.compiled, jit.bytes, jit.rejected, jit.calls, jit.deopts,
+    jit.threshold);
+}
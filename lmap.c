@@ -0,0 +1,263 @@
+#include "lispy.h"
+
+/* Hash table behind LVAL_MAP.
+
+   An open addressing table in the style of a Swiss table. Next to the
+   slots is an array of control bytes, one per slot, telling whether it
+   is empty, deleted, or full, and then holding 7 bits of the hash of
+   its key. Probing looks at a group of 16 control bytes at a time, so
+   finding a key is mostly one compare of those 7 bits against the
+   whole group, done with SSE2 where there is one. Only slots whose
+   control byte matches get their key compared with lval_eq.
+
+   Groups are probed quadratically from the one the hash starts at,
+   until a group with an empty slot shows the key can't be further on.
+   Deleting leaves a tombstone behind so that probing carries on past
+   it. The table holds at most 7/8 of its slots full or deleted, then
+   grows, or just drops the tombstones if that frees enough.
+
+   The control bytes are followed by a copy of the first 16, so a group
+   can be read starting at any slot without wrapping around.
+
+   The table holds a reference to each key and value. */
+
+#ifdef __SSE2__
+  #include <emmintrin.h>
+#endif
+
+#define LMAP_GROUP 16
+
+enum { LMAP_EMPTY = -128, LMAP_DELETED = -2 };
+
+typedef struct lslotkv
+{
+  lval* key;
+  lval* val;
+} lslotkv;
+
+struct lmap
+{
+  int8_t*  ctrl;
+  lslotkv* slots;
+  int      cap;    /* a power of two, at least LMAP_GROUP */
+  int      count;
+  int      left;   /* empty slots that can still be filled before growing */
+};
+
+static int lmap_limit(int cap) { return cap - cap / 8; }
+
+static lmap* lmap_alloc(int cap)
+{
+  lmap* m  = malloc(sizeof(lmap));
+  m->ctrl  = malloc(cap + LMAP_GROUP);
+  m->slots = malloc(sizeof(lslotkv) * cap);
+  m->cap   = cap;
+  m->count = 0;
+  m->left  = lmap_limit(cap);
+  memset(m->ctrl, LMAP_EMPTY, cap + LMAP_GROUP);
+  return m;
+}
+
+lmap* lmap_new(void) { return lmap_alloc(LMAP_GROUP); }
+
+void lmap_free(lmap* m)
+{
+  for (int i = 0; i < m->cap; i++) {
+    if (m->ctrl[i] >= 0) {
+      lval_del(m->slots[i].key);
+      lval_del(m->slots[i].val);
+    }
+  }
+  free(m->ctrl);
+  free(m->slots);
+  free(m);
+}
+
+lmap* lmap_copy(lmap* m)
+{
+  lmap* x = malloc(sizeof(lmap));
+  *x = *m;
+  x->ctrl  = malloc(m->cap + LMAP_GROUP);
+  x->slots = malloc(sizeof(lslotkv) * m->cap);
+  memcpy(x->ctrl, m->ctrl, m->cap + LMAP_GROUP);
+  for (int i = 0; i < m->cap; i++) {
+    if (m->ctrl[i] < 0) { continue; }
+    x->slots[i].key = lval_ref(m->slots[i].key);
+    x->slots[i].val = lval_ref(m->slots[i].val);
+  }
+  return x;
+}
+
+int lmap_count(lmap* m) { return m->count; }
+
+/* The first full slot at or after i, or -1 */
+int lmap_next(lmap* m, int i)
+{
+  for (; i < m->cap; i++) {
+    if (m->ctrl[i] >= 0) { return i; }
+  }
+  return -1;
+}
+
+lval* lmap_key(lmap* m, int i) { return m->slots[i].key; }
+lval* lmap_val(lmap* m, int i) { return m->slots[i].val; }
+
+/* #region Groups */
+
+/* Bit i set for each control byte i of the group at g equal to h */
+static unsigned lmap_match(int8_t* g, int8_t h)
+{
+#ifdef __SSE2__
+  __m128i x = _mm_loadu_si128((const __m128i*)g);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8(h)));
+#else
+  unsigned r = 0;
+  for (int i = 0; i < LMAP_GROUP; i++) {
+    if (g[i] == h) { r |= 1u << i; }
+  }
+  return r;
+#endif
+}
+
+/* Bit i set for each empty or deleted slot, the only ones with the
+   sign bit set */
+static unsigned lmap_match_free(int8_t* g)
+{
+#ifdef __SSE2__
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)g));
+#else
+  unsigned r = 0;
+  for (int i = 0; i < LMAP_GROUP; i++) {
+    if (g[i] < 0) { r |= 1u << i; }
+  }
+  return r;
+#endif
+}
+
+static int lmap_lowest(unsigned bits) { return __builtin_ctz(bits); }
+
+static void lmap_set_ctrl(lmap* m, int i, int8_t h)
+{
+  m->ctrl[i] = h;
+  if (i < LMAP_GROUP) { m->ctrl[m->cap + i] = h; }
+}
+
+/* Where probing for a hash starts, and the 7 bits kept of it */
+static int    lmap_h1(lmap* m, uint32_t h) { return (h >> 7) & (m->cap - 1); }
+static int8_t lmap_h2(uint32_t h)          { return h & 0x7F; }
+
+/* #endregion Groups */
+
+/* The slot holding k, or -1 */
+static int lmap_find(lmap* m, lval* k, uint32_t h)
+{
+  int    mask = m->cap - 1;
+  int    pos  = lmap_h1(m, h);
+  int8_t h2   = lmap_h2(h);
+
+  for (int step = LMAP_GROUP;; step += LMAP_GROUP) {
+    int8_t*  g    = m->ctrl + pos;
+    unsigned bits = lmap_match(g, h2);
+    while (bits) {
+      int i = (pos + lmap_lowest(bits)) & mask;
+      if (lval_eq(m->slots[i].key, k)) { return i; }
+      bits &= bits - 1;
+    }
+    if (lmap_match(g, LMAP_EMPTY)) { return -1; }
+    pos = (pos + step) & mask;
+  }
+}
+
+/* The first empty or deleted slot probing for h finds */
+static int lmap_find_free(lmap* m, uint32_t h)
+{
+  int mask = m->cap - 1;
+  int pos  = lmap_h1(m, h);
+
+  for (int step = LMAP_GROUP;; step += LMAP_GROUP) {
+    unsigned bits = lmap_match_free(m->ctrl + pos);
+    if (bits) { return (pos + lmap_lowest(bits)) & mask; }
+    pos = (pos + step) & mask;
+  }
+}
+
+/* Move every entry into a table of cap slots, leaving the tombstones */
+static void lmap_rehash(lmap* m, int cap)
+{
+  lmap* x = lmap_alloc(cap);
+  for (int i = 0; i < m->cap; i++) {
+    if (m->ctrl[i] < 0) { continue; }
+    uint32_t h = lval_hash(m->slots[i].key);
+    int      j = lmap_find_free(x, h);
+    lmap_set_ctrl(x, j, lmap_h2(h));
+    x->slots[j] = m->slots[i];
+  }
+  x->count = m->count;
+  x->left -= m->count;
+
+  free(m->ctrl);
+  free(m->slots);
+  *m = *x;
+  free(x);
+}
+
+lval* lmap_get(lmap* m, lval* k)
+{
+  int i = lmap_find(m, k, lval_hash(k));
+  return i < 0 ? NULL : m->slots[i].val;
+}
+
+/* Bind k to v, taking over the references to both */
+void lmap_put(lmap* m, lval* k, lval* v)
+{
+  uint32_t h = lval_hash(k);
+  int      i = lmap_find(m, k, h);
+  if (i >= 0) {
+    lval_del(k);
+    lval_del(m->slots[i].val);
+    m->slots[i].val = v;
+    return;
+  }
+
+  i = lmap_find_free(m, h);
+  if (m->left == 0 && m->ctrl[i] == LMAP_EMPTY) {
+    /* Dropping the tombstones is enough unless the table is mostly full */
+    int cap = m->count * 2 >= lmap_limit(m->cap) ? m->cap * 2 : m->cap;
+    lmap_rehash(m, cap);
+    i = lmap_find_free(m, h);
+  }
+
+  if (m->ctrl[i] == LMAP_EMPTY) { m->left--; }
+  lmap_set_ctrl(m, i, lmap_h2(h));
+  m->slots[i].key = k;
+  m->slots[i].val = v;
+  m->count++;
+}
+
+/* Remove k, returning whether it was there */
+int lmap_remove(lmap* m, lval* k)
+{
+  int i = lmap_find(m, k, lval_hash(k));
+  if (i < 0) { return 0; }
+
+  lval_del(m->slots[i].key);
+  lval_del(m->slots[i].val);
+  m->count--;
+
+  /* If every group read through this slot also has an empty slot in
+     it, no probe ever went past it, and it can be empty again rather
+     than a tombstone. That is when the empty slots closest to it on
+     either side are less than a group apart */
+  unsigned after  = lmap_match(m->ctrl + i, LMAP_EMPTY);
+  unsigned before = lmap_match(m->ctrl + ((i - LMAP_GROUP) & (m->cap - 1)),
+    LMAP_EMPTY);
+  if (after && before
+    && __builtin_ctz(after) + (__builtin_clz(before) - 16) < LMAP_GROUP)
+  {
+    lmap_set_ctrl(m, i, LMAP_EMPTY);
+    m->left++;
+  } else {
+    lmap_set_ctrl(m, i, LMAP_DELETED);
+  }
+  return 1;
+}
@@ -0,0 +1,96 @@
+#include "lispy.h"
+
+/* Symbol intern table.
+
+   Every symbol name is stored once, here, and symbols refer to it by
+   pointer. Two symbols are the same exactly when their pointers are,
+   so environment lookups and lval_eq never need strcmp, and making or
+   copying a symbol never allocates a new name. Names live until
+   lsym_cleanup.
+
+   The table is open addressed with linear probing and kept at most
+   half full. */
+
+static struct
+{
+  char**    names;
+  uint32_t* hashes;
+  size_t    count;
+  size_t    cap;
+} syms;
+
+/* The '&' that marks variable arguments in a lambda's formals */
+char* lsym_rest;
+
+/* The 'if' that lvm_compile looks for */
+char* lsym_if;
+
+uint32_t lsym_hash(char* s)
+{
+  /* FNV-1a */
+  uint32_t h = 2166136261u;
+  while (*s) { h = (h ^ (unsigned char)*s++) * 16777619u; }
+  return h;
+}
+
+static void lsym_grow(void)
+{
+  size_t    cap    = syms.cap ? syms.cap * 2 : 256;
+  char**    names  = calloc(cap, sizeof(char*));
+  uint32_t* hashes = malloc(sizeof(uint32_t) * cap);
+
+  for (size_t i = 0; i < syms.cap; i++)
+  {
+    if (!syms.names[i]) { continue; }
+    size_t j = syms.hashes[i] & (cap - 1);
+    while (names[j]) { j = (j + 1) & (cap - 1); }
+    names[j]  = syms.names[i];
+    hashes[j] = syms.hashes[i];
+  }
+
+  free(syms.names);
+  free(syms.hashes);
+  syms.names  = names;
+  syms.hashes = hashes;
+  syms.cap    = cap;
+}
+
+char* lsym_intern(char* s)
+{
+  if (2 * (syms.count + 1) > syms.cap) { lsym_grow(); }
+
+  uint32_t h = lsym_hash(s);
+  size_t   i = h & (syms.cap - 1);
+  while (syms.names[i])
+  {
+    if (syms.hashes[i] == h && strcmp(syms.names[i], s) == 0)
+    {
+      return syms.names[i];
+    }
+    i = (i + 1) & (syms.cap - 1);
+  }
+
+  syms.names[i]  = malloc(strlen(s) + 1);
+  syms.hashes[i] = h;
+  strcpy(syms.names[i], s);
+  syms.count++;
+  return syms.names[i];
+}
+
+void lsym_init(void)
+{
+  lsym_rest = lsym_intern("&");
+  lsym_if   = lsym_intern("if");
+}
+
+void lsym_cleanup(void)
+{
+  for (size_t i = 0; i < syms.cap; i++) { free(syms.names[i]); }
+  free(syms.names);
+  free(syms.hashes);
+  syms.names  = NULL;
+  syms.hashes = NULL;
+  syms.count  = syms.cap = 0;
+  lsym_rest   = NULL;
+  lsym_if     = NULL;
+}
@@ -4,19 +4,45 @@
 
 /* lval type constructors */ 
 
+static lval* lval_new(int type)
+{
+  lval* v  = lval_alloc();
+  v->type  = type;
+  v->flags = 0;
+  v->refs  = 1;
+  
+  return v;
+}
+
 lval* lval_num(long x)
 {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_NUM;
+  if (x >= LVAL_FIXNUM_MIN && x <= LVAL_FIXNUM_MAX) { return LVAL_FIXNUM(x); }
+  
+  lval* v = lval_new(LVAL_NUM);
   v->num  = x;
   
   return v;
 }
 
+lval* lval_dbl(double x)
+{
+  union { double d; uint64_t w; } u = { x };
+  int top = (u.w >> 60) & 7;
+  if ((top == 3 || top == 4) && u.w != (uint64_t)3 << 60) {
+    u.w = u.w << 3 | u.w >> 61;
+    return (lval*)(uintptr_t)((u.w & ~(uint64_t)3) | 2);
+  }
+  if (u.w == 0) { return (lval*)(uintptr_t)LVAL_FLONUM_ZERO; }
+  
+  lval* v = lval_new(LVAL_DBL);
+  v->dbl  = x;
+  
+  return v;
+}
+
 lval* lval_err(char* fmt, ...)
 {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
+  lval* v = lval_new(LVAL_ERR);
   va_list va;
   va_start(va, fmt);
   v->err = malloc(512);
@@ -29,17 +55,14 @@ lval* lval_err(char* fmt, ...)
 
 lval* lval_sym(char* s)
 {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
-  v->sym  = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
+  lval* v = lval_new(LVAL_SYM);
+  v->sym  = lsym_intern(s);
   return v;
 }
 
 lval* lval_str(char* s)
 {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_STR;
+  lval* v = lval_new(LVAL_STR);
   v->str  = malloc(strlen(s) + 1);
   strcpy(v->str, s);
   return v;
@@ -47,55 +70,139 @@ lval* lval_str(char* s)
 
 lval* lval_builtin(lbuiltin func)
 {
-  lval* v    = malloc(sizeof(lval));
-  v->type    = LVAL_FUN;
+  lval* v    = lval_new(LVAL_FUN);
+  v->flags   = LVAL_BUILTIN;
   v->builtin = func;
   
   return v;
 }
 
-lval* lval_lambda(lval* formals, lval* body)
+/* A lambda closing over env, taking over the references to all three.
+   body is compiled, see lvm_compile */
+lval* lval_lambda(lval* env, lval* formals, lval* body)
 {
-  lval* v    = malloc(sizeof(lval));
-  v->type    = LVAL_FUN; 
-  v->builtin = NULL;
-  v->env     = lenv_new();
+  lval* v    = lval_new(LVAL_FUN);
+  v->env     = env;
   v->formals = formals;
   v->body    = body;
   
   return v;
 }
 
+/* A new empty environment inside the LVAL_ENV par, or a global one if
+   par is NULL */
+lval* lval_env(lval* par)
+{
+  lenv* e  = lenv_alloc();
+  e->par   = par ? par->vars : NULL;
+  e->count = 0;
+  e->cap   = 0;
+  e->syms  = NULL;
+  e->vals  = NULL;
+  
+  lval* v  = lval_new(LVAL_ENV);
+  v->vars  = e;
+  v->outer = par ? lval_ref(par) : NULL;
+  e->self  = v;
+  return v;
+}
+
+lval* lval_map(void)
+{
+  lval* v = lval_new(LVAL_MAP);
+  v->map  = lmap_new();
+  return v;
+}
+
+/* A persistent map, taking over the reference to root */
+lval* lval_pmap(lval* root, int nkeys)
+{
+  lval* v  = lval_new(LVAL_PMAP);
+  v->root  = root;
+  v->nkeys = nkeys;
+  return v;
+}
+
+/* A vector of len numbers, left for the caller to fill in */
+lval* lval_vec(int elem, int len)
+{
+  size_t size = elem == LVEC_INT ? sizeof(int64_t) : sizeof(double);
+  lval* v = lval_new(LVAL_VEC);
+  v->ints = malloc(size * (len ? len : 1));
+  v->len  = len;
+  v->elem = elem;
+  return v;
+}
+
+/* Expressions start out empty, and so packed until something other
+   than a fixnum goes in, see lval_add */
+
 lval* lval_sexpr(void)
 {
-  lval* v  = malloc(sizeof(lval));
-  v->type  = LVAL_SEXPR;
+  lval* v  = lval_new(LVAL_SEXPR);
+  v->flags = LVAL_PACKED;
   v->count = 0;
-  v->cell = NULL;
+  v->start = 0;
+  v->cap   = 0;
+  v->cell  = NULL;
   
   return v;
 }
 
 lval* lval_qexpr(void)
 {
-  lval* v  = malloc(sizeof(lval));
-  v->type  = LVAL_QEXPR;
+  lval* v  = lval_new(LVAL_QEXPR);
+  v->flags = LVAL_PACKED;
   v->count = 0;
+  v->start = 0;
+  v->cap   = 0;
   v->cell  = NULL;
   
   return v;
 }
 
+static void lval_reserve(lval* v, int n);
+
+/* An S-Expression of the n values at x, taking over their references */
+lval* lval_sexpr_of(lval** x, int n)
+{
+  lval* v = lval_sexpr();
+  if (n) {
+    lval_reserve(v, n);
+    memcpy(v->cell, x, sizeof(lval*) * n);
+    v->count = n;
+  }
+  for (int i = 0; i < n; i++) {
+    if (!LVAL_IS_FIXNUM(x[i])) { v->flags &= ~LVAL_PACKED; }
+  }
+  return v;
+}
+
 /* lval destructors */
 
-void lval_del(lval* v)
+/* Values whose last reference went while lval_del was already nested
+   LVAL_DEL_DEPTH deep. The outermost lval_del frees them, so freeing a
+   deeply nested value takes bounded C stack */
+#define LVAL_DEL_DEPTH 256
+
+static struct
+{
+  lval** items;
+  int    count;
+  int    cap;
+  int    depth;
+} dying;
+
+/* Free v, dropping its references to other values */
+static void lval_release(lval* v)
 {
   switch(v->type)
   {
-    case LVAL_NUM   : break;
+    case LVAL_NUM   : 
+    case LVAL_DBL   : break;
     case LVAL_FUN   : 
-      if (!v->builtin) {
-        lenv_del(v->env);
+      if (!LVAL_IS_BUILTIN(v)) {
+        lval_del(v->env);
         lval_del(v->formals);
         lval_del(v->body);
       }
@@ -103,135 +210,750 @@ void lval_del(lval* v)
     case LVAL_ERR   :
       free(v->err);
       break;
-    case LVAL_SYM   :
-      free(v->sym);
-      break;
     case LVAL_STR   :
       free(v->str); 
       break;
     case LVAL_QEXPR : 
     case LVAL_SEXPR :
-      for(int i = 0; i < v->count; i++)
+      if (v->flags & LVAL_SHARED) {
+        lval_del(v->cells);
+        break;
+      }
+      for(int i = 0; i < v->count && !LVAL_IS_PACKED(v); i++)
       {
         lval_del(v->cell[i]);
       }
-      free(v->cell);
+      free(v->cell - v->start);
+      break;
+    case LVAL_CELLS :
+      for(int i = v->lo; i < v->used && !LVAL_IS_PACKED(v); i++)
+      {
+        lval_del(v->items[i]);
+      }
+      free(v->items);
+      break;
+    case LVAL_CODE  :
+      lval_del(v->src);
+      lvm_free(v->code);
+      break;
+    case LVAL_ENV   :
+      lenv_del(v->vars);
+      if (v->outer) { lval_del(v->outer); }
+      break;
+    case LVAL_MAP   :
+      lmap_free(v->map);
+      break;
+    case LVAL_PMAP  :
+      if (v->root) { lval_del(v->root); }
+      break;
+    case LVAL_VEC   :
+      free(v->ints);
+      break;
+    case LVAL_NODE  :
+      for (int i = 0; i < 2 * v->nkids; i++)
+      {
+        if (v->kids[i]) { lval_del(v->kids[i]); }
+      }
+      free(v->kids);
       break;
   }
   
-  free(v);
+  lval_free(v);
+}
+
+void lval_del(lval* v)
+{
+  if (LVAL_IS_IMMEDIATE(v)) { return; }
+  
+  /* Only drop our reference if the value is still shared */
+  if (--v->refs > 0) { return; }
+  
+  if (dying.depth == LVAL_DEL_DEPTH)
+  {
+    if (dying.count == dying.cap)
+    {
+      dying.cap   = dying.cap ? dying.cap * 2 : 256;
+      dying.items = realloc(dying.items, sizeof(lval*) * dying.cap);
+    }
+    dying.items[dying.count++] = v;
+    return;
+  }
+  
+  dying.depth++;
+  lval_release(v);
+  dying.depth--;
+  if (dying.depth > 0 || !dying.items) { return; }
+  
+  /* Freeing these can put off more */
+  while (dying.count > 0)
+  {
+    lval* x = dying.items[--dying.count];
+    dying.depth++;
+    lval_release(x);
+    dying.depth--;
+  }
+  free(dying.items);
+  dying.items = NULL;
+  dying.cap   = 0;
+}
+
+/* reference counting helpers */
+
+lval* lval_ref(lval* v)
+{
+  if (!LVAL_IS_IMMEDIATE(v)) { v->refs++; }
+  return v;
+}
+
+/* Move the elements of an expression into a cells buffer, so that
+   copies of it can share them. This doesn't change its value, or where
+   its elements are in memory */
+
+static lval* lval_cells(lval* v)
+{
+  if (v->flags & LVAL_SHARED) { return v->cells; }
+  
+  lval* b  = lval_new(LVAL_CELLS);
+  b->flags = v->flags & LVAL_PACKED;
+  b->items = v->cell - v->start;
+  b->lo    = v->start;
+  b->used  = v->start + v->count;
+  b->size  = v->cap;
+  
+  v->cells  = b;
+  v->flags |= LVAL_SHARED;
+  return b;
 }
 
-/* helper function to copy lvals */
+/* Copy the top level of a value. The children of the copy are shared
+   with the original, which is safe since shared values are immutable.
+   So are the elements of an expression, see lval_cells */
 
 lval* lval_copy(lval* v) {
-  lval* x = malloc(sizeof(lval));
-  x->type = v->type;
+  if (LVAL_IS_IMMEDIATE(v)) { return v; }
+  
+  lval* x = lval_new(v->type);
+  x->flags = v->flags & LVAL_BUILTIN;
   switch (v->type) {
     case LVAL_FUN:
-      if (v->builtin) {
+      if (LVAL_IS_BUILTIN(v)) {
         x->builtin = v->builtin;
       } else {
-        x->builtin = NULL;
-        x->env = lenv_copy(v->env);
-        x->formals = lval_copy(v->formals);
-        x->body = lval_copy(v->body);
+        x->env = lval_ref(v->env);
+        x->formals = lval_ref(v->formals);
+        x->body = lval_ref(v->body);
       }
     break;
     case LVAL_NUM: x->num = v->num; break;
+    case LVAL_DBL: x->dbl = v->dbl; break;
     case LVAL_ERR: x->err = malloc(strlen(v->err) + 1);
       strcpy(x->err, v->err);
     break;
-    case LVAL_SYM: x->sym = malloc(strlen(v->sym) + 1);
-      strcpy(x->sym, v->sym);
+    case LVAL_SYM: x->sym = v->sym;
+    break;
+    case LVAL_MAP: x->map = lmap_copy(v->map);
+    break;
+    case LVAL_PMAP: x->root = v->root ? lval_ref(v->root) : NULL;
+      x->nkeys = v->nkeys;
+    break;
+    case LVAL_VEC: {
+      size_t size = v->elem == LVEC_INT ? sizeof(int64_t) : sizeof(double);
+      x->ints = malloc(size * (v->len ? v->len : 1));
+      x->len  = v->len;
+      x->elem = v->elem;
+      memcpy(x->ints, v->ints, size * v->len);
+    }
+    break;
+    case LVAL_STR: x->str = malloc(strlen(v->str) + 1);
+      strcpy(x->str, v->str);
     break;
     case LVAL_SEXPR:
     case LVAL_QEXPR:
-      x->count = v->count;
-      x->cell = malloc(sizeof(lval*) * x->count);
-      for (int i = 0; i < x->count; i++) {
-        x->cell[i] = lval_copy(v->cell[i]);
+      x->count  = v->count;
+      x->flags |= v->flags & LVAL_PACKED;
+      if (v->count == 0) {
+        x->start = 0;
+        x->cap   = 0;
+        x->cell  = NULL;
+        break;
       }
+      x->cells  = lval_ref(lval_cells(v));
+      x->cell   = v->cell;
+      x->flags |= LVAL_SHARED | (v->flags & LVAL_HASHED);
+      x->hash   = v->hash;
     break;
   }
   return x;
 }
 
+/* Give an unshared expression an array of its own again, holding
+   exactly its elements, so they can be changed in place */
+
+static void lval_own(lval* v)
+{
+  if (!(v->flags & LVAL_SHARED)) { return; }
+  
+  lval* b = v->cells;
+  v->flags &= ~LVAL_SHARED;
+  
+  if (b->refs > 1) {
+    lval** cell = malloc(sizeof(lval*) * (v->count ? v->count : 1));
+    if (LVAL_IS_PACKED(v)) {
+      memcpy(cell, v->cell, sizeof(lval*) * v->count);
+    } else {
+      for (int i = 0; i < v->count; i++) { cell[i] = lval_ref(v->cell[i]); }
+    }
+    v->cell  = cell;
+    v->start = 0;
+    v->cap   = v->count;
+    lval_del(b);
+    return;
+  }
+  
+  /* We are the only user, take the array back and release what has
+     been sliced off */
+  int start = v->cell - b->items;
+  if (!LVAL_IS_PACKED(b)) {
+    for (int i = b->lo; i < start; i++) { lval_del(b->items[i]); }
+    for (int i = start + v->count; i < b->used; i++) { lval_del(b->items[i]); }
+  }
+  v->start = start;
+  v->cap   = b->size;
+  
+  b->items = NULL;
+  b->lo    = 0;
+  b->used  = 0;
+  lval_del(b);
+}
+
+/* Get a value that is safe to change in place. A value only referenced
+   by the caller is returned as is, otherwise the caller's reference is
+   swapped for a private copy */
+
+lval* lval_unshare(lval* v)
+{
+  if (LVAL_IS_IMMEDIATE(v)) { return v; }
+  
+  if (v->refs > 1) {
+    lval* x = lval_copy(v);
+    lval_del(v);
+    v = x;
+  }
+  if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+    lval_own(v);
+    v->flags &= ~LVAL_HASHED;
+  }
+  return v;
+}
+
 /* used via builtin methods */
 
+/* Make room for n more elements at the back of v, which must own its
+   array */
+static void lval_reserve(lval* v, int n)
+{
+  if (v->start + v->count + n <= v->cap) { return; }
+  
+  lval** base = v->cell - v->start;
+  
+  /* Reuse the space left by popping from the front if that frees
+     enough, otherwise grow geometrically */
+  if (v->count + n <= v->cap / 2) {
+    memmove(base, v->cell, sizeof(lval*) * v->count);
+  } else {
+    int cap = v->cap ? v->cap * 2 : 4;
+    if (cap < v->count + n) { cap = v->count + n; }
+    lval** cell = malloc(sizeof(lval*) * cap);
+    if (v->count) { memcpy(cell, v->cell, sizeof(lval*) * v->count); }
+    free(base);
+    base   = cell;
+    v->cap = cap;
+  }
+  
+  v->cell  = base;
+  v->start = 0;
+}
+
 lval* lval_add(lval* v, lval* x)
 {
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  v->cell[v->count - 1] = x;
+  v = lval_unshare(v);
+  lval_reserve(v, 1);
+  v->cell[v->count++] = x;
+  if (!LVAL_IS_FIXNUM(x)) { v->flags &= ~LVAL_PACKED; }
   return v;
 }
 
 lval* lval_join(lval* x, lval* y)
 {
-  for(int i = 0; i < y->count; i++)
+  x = lval_unshare(x);
+  lval_reserve(x, y->count);
+  if (!LVAL_IS_PACKED(y)) { x->flags &= ~LVAL_PACKED; }
+  
+  /* Move the cells of y if it's ours, otherwise share them */
+  if (y->refs == 1)
+  {
+    lval_own(y);
+    if (y->count) {
+      memcpy(x->cell + x->count, y->cell, sizeof(lval*) * y->count);
+    }
+    x->count += y->count;
+    free(y->cell - y->start);
+    lval_free(y);
+  }
+  else if (LVAL_IS_PACKED(y))
   {
-    x = lval_add(x, y->cell[i]);
-    lval_del(y->cell[i]);
+    if (y->count) {
+      memcpy(x->cell + x->count, y->cell, sizeof(lval*) * y->count);
+    }
+    x->count += y->count;
+    lval_del(y);
+  }
+  else
+  {
+    for(int i = 0; i < y->count; i++)
+    {
+      x->cell[x->count++] = lval_ref(y->cell[i]);
+    }
+    lval_del(y);
   }
-  free(y->cell);
-  free(y);  
   return x;
 }
 
+/* v must not be shared, see lval_unshare */
 
 lval* lval_pop(lval* v, int i)
 {
   lval* x = v->cell[i];
-  memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval*) * (v->count - i - 1));
-  v->count--;  
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+  v->flags &= ~LVAL_HASHED;
+  
+  /* Popping the front just moves the start of the elements along */
+  if (i == 0) {
+    v->cell++;
+    v->start++;
+  } else {
+    memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval*) * (v->count - i - 1));
+  }
+  v->count--;
   return x;
 }
 
+/* Narrow v down to its n elements starting at i. The elements aren't
+   copied, if v is shared the result looks into the same cells */
+
+lval* lval_slice(lval* v, int i, int n)
+{
+  if (v->refs > 1) {
+    lval* x = lval_copy(v);
+    lval_del(v);
+    v = x;
+  }
+  
+  if (!(v->flags & LVAL_SHARED)) {
+    if (!LVAL_IS_PACKED(v)) {
+      for (int k = 0; k < i; k++) { lval_del(v->cell[k]); }
+      for (int k = i + n; k < v->count; k++) { lval_del(v->cell[k]); }
+    }
+    v->start += i;
+  }
+  v->cell  += i;
+  v->count  = n;
+  v->flags &= ~LVAL_HASHED;
+  
+  /* If nobody else is looking at the cells any more, take them back */
+  if ((v->flags & LVAL_SHARED) && v->cells->refs == 1) { lval_own(v); }
+  return v;
+}
+
 lval* lval_take(lval* v, int i)
 {
-  lval* x = lval_pop(v, i);
+  lval* x = lval_ref(v->cell[i]);
   lval_del(v);
   return x;
 }
 
-/* print functions */
+/* Hashing. Values that are equal by lval_eq hash the same. The hash of
+   an expression is cached in it until it changes in place, so hashing
+   a value shared by many others, or hashing it again, only looks at
+   what is new. The entries of a map are summed, which doesn't depend
+   on their order. Works through a stack like printing does */
+
+static uint32_t lval_hash_mix(uint32_t h, uint32_t x)
+{
+  h = (h ^ x) * 0x9E3779B1u;
+  return h ^ (h >> 15);
+}
+
+static int lval_hashed(lval* v)
+{
+  if (LVAL_IS_IMMEDIATE(v)) { return 1; }
+  switch (v->type) {
+    case LVAL_SEXPR:
+    case LVAL_QEXPR: return v->flags & (LVAL_HASHED | LVAL_PACKED);
+    case LVAL_CODE:
+    case LVAL_MAP:
+    case LVAL_PMAP:  return 0;
+    case LVAL_FUN:   return LVAL_IS_BUILTIN(v);
+  }
+  return 1;
+}
+
+static uint32_t lval_hash_num(uint32_t h, long x)
+{
+  unsigned long n = x;
+  h = lval_hash_mix(h, (uint32_t)n);
+  return lval_hash_mix(h, (uint32_t)(n >> 16 >> 16));
+}
+
+/* The hash lval_hash would work out for a list of numbers, without
+   going through its stack */
+static uint32_t lval_hash_packed(lval* v)
+{
+  uint32_t h   = lval_hash_mix(0, v->type);
+  uint32_t num = lval_hash_mix(0, LVAL_NUM);
+  for (int i = 0; i < v->count; i++) {
+    h = lval_hash_mix(h, lval_hash_num(num, LVAL_FIXNUM_VAL(v->cell[i])));
+  }
+  v->hash   = lval_hash_mix(h, v->count);
+  v->flags |= LVAL_HASHED;
+  return v->hash;
+}
+
+/* The hash of a value that has no children, or has it cached */
+static uint32_t lval_hash_leaf(lval* v)
+{
+  uint32_t h = lval_hash_mix(0, LVAL_TYPE(v));
+  switch (LVAL_TYPE(v)) {
+    case LVAL_NUM:   return lval_hash_num(h, LVAL_NUM_VAL(v));
+    case LVAL_DBL: {
+      /* A whole double == the Number it holds, so they hash the same */
+      double d = LVAL_DBL_VAL(v);
+      if (d >= (double)LONG_MIN && d < -(double)LONG_MIN && d == (long)d) {
+        return lval_hash_num(lval_hash_mix(0, LVAL_NUM), (long)d);
+      }
+      uint64_t n;
+      memcpy(&n, &d, sizeof(n));
+      return lval_hash_mix(lval_hash_mix(h, (uint32_t)n), (uint32_t)(n >> 32));
+    }
+    case LVAL_ERR:   return lval_hash_mix(h, lsym_hash(v->err));
+    case LVAL_SYM:   return lval_hash_mix(h, lsym_hash(v->sym));
+    case LVAL_STR:   return lval_hash_mix(h, lsym_hash(v->str));
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      return v->flags & LVAL_HASHED ? v->hash : lval_hash_packed(v);
+    case LVAL_VEC:
+      for (int i = 0; i < v->len; i++) {
+        uint64_t n = v->ints[i];
+        if (v->elem == LVEC_DBL) {
+          /* A whole double == the integer it holds, -0.0 included, so
+             both kinds of vector hash it as one */
+          double d = v->dbls[i];
+          if (d >= (double)LONG_MIN && d < -(double)LONG_MIN && d == (long)d) {
+            n = (long)d;
+          } else {
+            memcpy(&n, &d, sizeof(n));
+          }
+        }
+        h = lval_hash_mix(lval_hash_mix(h, (uint32_t)n), (uint32_t)(n >> 32));
+      }
+      return lval_hash_mix(h, v->len);
+  }
+
+  /* Builtins only compare equal to themselves, so they needn't differ */
+  return h;
+}
+
+/* A value being hashed, the hash of the key of the map entry whose value
+   is next in e, and for a persistent map its entries, see lhamt_entries */
+typedef struct { lval* v; int i; uint32_t h; uint32_t e; lval** kv; } lhash;
+
+static int lval_hash_map(lval* v)
+{
+  return v->type == LVAL_MAP || v->type == LVAL_PMAP;
+}
+
+static lhash lval_hash_frame(lval* v)
+{
+  lhash f = { v, 0, lval_hash_mix(0, v->type), 0, NULL };
+  if (v->type == LVAL_PMAP) { f.kv = lhamt_entries(v->root, v->nkeys); }
+  return f;
+}
+
+static void lval_hash_add(lhash* p, uint32_t h)
+{
+  if (!lval_hash_map(p->v)) {
+    p->h = lval_hash_mix(p->h, h);
+  } else if (p->i % 2) {
+    p->e = h;
+  } else {
+    p->h += lval_hash_mix(p->e, h);
+  }
+}
+
+uint32_t lval_hash(lval* v)
+{
+  if (lval_hashed(v)) { return lval_hash_leaf(v); }
+
+  /* Most values nest only a few deep, so start on the C stack */
+  lhash  local[16];
+  lhash* s   = local;
+  int    n   = 0;
+  int    cap = 16;
+  uint32_t h = 0;
+
+  s[n++] = lval_hash_frame(v);
+  while (n) {
+    lhash* top = &s[n - 1];
+    lval*  x   = top->v;
+    lval*  c   = NULL;
+
+    /* The next child, a lambda being its formals and body */
+    switch (x->type) {
+      case LVAL_SEXPR:
+      case LVAL_QEXPR:
+        if (top->i < x->count) { c = x->cell[top->i]; }
+        break;
+      case LVAL_FUN:
+        if (top->i < 2) { c = top->i ? x->body : x->formals; }
+        break;
+      case LVAL_CODE:
+        if (top->i < 1) { c = x->src; }
+        break;
+      case LVAL_MAP:
+        if (top->i % 2) {
+          c = lmap_val(x->map, top->i / 2);
+        } else {
+          int j = lmap_next(x->map, top->i / 2);
+          if (j >= 0) {
+            top->i = 2 * j;
+            c = lmap_key(x->map, j);
+          }
+        }
+        break;
+      case LVAL_PMAP:
+        if (top->i < 2 * x->nkeys) { c = top->kv[top->i]; }
+        break;
+    }
+
+    if (!c) {
+      int size = top->i;
+      if (x->type == LVAL_MAP)  { size = lmap_count(x->map); }
+      if (x->type == LVAL_PMAP) { size = x->nkeys; free(top->kv); }
+      h = lval_hash_mix(top->h, size);
+      if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+        x->hash   = h;
+        x->flags |= LVAL_HASHED;
+      }
+      if (--n) { lval_hash_add(&s[n - 1], h); }
+      continue;
+    }
+
+    top->i++;
+    if (lval_hashed(c)) {
+      lval_hash_add(top, lval_hash_leaf(c));
+      continue;
+    }
+
+    if (n == cap) {
+      lhash* t = malloc(sizeof(lhash) * cap * 2);
+      memcpy(t, s, sizeof(lhash) * cap);
+      if (s != local) { free(s); }
+      s = t;
+      cap *= 2;
+    }
+    s[n++] = lval_hash_frame(c);
+  }
+
+  if (s != local) { free(s); }
+  return h;
+}
+
+/* print functions. Printing works through a stack of what is left to
+   print rather than recursing, so values nest as deep as memory allows */
+
+/* A value left to print, or the character c when v is NULL */
+typedef struct { lval* v; char c; } lprint;
+
+static void lval_print_push(lprint** s, int* n, int* cap, lval* v, char c)
+{
+  if (*n == *cap)
+  {
+    *cap = *cap ? *cap * 2 : 32;
+    *s   = realloc(*s, sizeof(lprint) * *cap);
+  }
+  (*s)[*n].v = v;
+  (*s)[*n].c = c;
+  (*n)++;
+}
+
+static void lval_print_expr(lprint** s, int* n, int* cap, lval* v,
+  char open, char close)
+{
+  putchar(open);
+  if (LVAL_IS_PACKED(v))
+  {
+    for (int i = 0; i < v->count; i++)
+    {
+      printf(i ? " %li" : "%li", LVAL_NUM_VAL(v->cell[i]));
+    }
+    putchar(close);
+    return;
+  }
+  lval_print_push(s, n, cap, NULL, close);
+  for(int i = v->count - 1; i >= 0; i--)
+  {
+    lval_print_push(s, n, cap, v->cell[i], 0);
+    if (i != 0) {
+      lval_print_push(s, n, cap, NULL, ' ');
+    }
+  }
+}
+
+static void lval_print_entry(lprint** s, int* n, int* cap, int first,
+  lval* k, lval* v)
+{
+  if (!first) {
+    lval_print_push(s, n, cap, NULL, ',');
+    lval_print_push(s, n, cap, NULL, ' ');
+  }
+  lval_print_push(s, n, cap, k, 0);
+  lval_print_push(s, n, cap, NULL, ' ');
+  lval_print_push(s, n, cap, v, 0);
+}
+
+/* A map prints as [k v, k v], a persistent map as #[k v, k v] */
+static void lval_print_map(lprint** s, int* n, int* cap, lval* v)
+{
+  if (v->type == LVAL_PMAP) { putchar('#'); }
+  putchar('[');
+  lval_print_push(s, n, cap, NULL, ']');
+  
+  /* Push the entries in order, then turn them around */
+  int base = *n;
+  if (v->type == LVAL_PMAP) {
+    lval** kv = lhamt_entries(v->root, v->nkeys);
+    for (int i = 0; i < v->nkeys; i++)
+    {
+      lval_print_entry(s, n, cap, i == 0, kv[2*i], kv[2*i+1]);
+    }
+    free(kv);
+  } else {
+    for (int i = lmap_next(v->map, 0); i >= 0; i = lmap_next(v->map, i + 1))
+    {
+      lval_print_entry(s, n, cap, *n == base,
+        lmap_key(v->map, i), lmap_val(v->map, i));
+    }
+  }
+  for (int i = base, j = *n - 1; i < j; i++, j--)
+  {
+    lprint t = (*s)[i];
+    (*s)[i] = (*s)[j];
+    (*s)[j] = t;
+  }
+}
+
+/* The fewest digits that read back as the same double. With point set
+   a whole double gets a '.0', so that it doesn't read back as a Number */
+static void lval_print_dbl(double d, int point)
+{
+  if (d != d) {
+    printf("nan");
+    return;
+  }
+  
+  char buf[32];
+  for (int p = 1; p <= 17; p++) {
+    snprintf(buf, sizeof(buf), "%.*g", p, d);
+    if (strtod(buf, NULL) == d) { break; }
+  }
+  
+  /* Rather than 5e+02, write out up to 15 digits before the point */
+  char* e = strchr(buf, 'e');
+  int   x = e ? atoi(e + 1) : -1;
+  if (x >= 0 && x < 15) { snprintf(buf, sizeof(buf), "%.*g", x + 1, d); }
+  printf("%s", buf);
+  if (point && buf[strspn(buf, "-0123456789")] == '\0') { printf(".0"); }
+}
+
+/* A vector prints as #i[1 2 3] when it holds integers, #f[1 2.5] when
+   it holds doubles */
+static void lval_print_vec(lval* v)
+{
+  printf(v->elem == LVEC_INT ? "#i[" : "#f[");
+  for (int i = 0; i < v->len; i++) {
+    if (i) { putchar(' '); }
+    if (v->elem == LVEC_INT) {
+      printf("%lli", (long long)v->ints[i]);
+    } else {
+      lval_print_dbl(v->dbls[i], 0);
+    }
+  }
+  putchar(']');
+}
 
 void lval_print(lval* v) 
 {
-  switch(v->type)
+  lprint* s   = NULL;
+  int     n   = 0;
+  int     cap = 0;
+  
+  for (;;)
   {
-    case LVAL_NUM   : 
-      printf("%li", v->num); 
-      break;
-    case LVAL_ERR   : 
-      printf("Error : %s", v->err); 
-      break;
-    case LVAL_SYM   :
-      printf("%s", v->sym);
-      break;
-    case LVAL_STR   :
-      lval_print_str(v);
-      break;
-    case LVAL_QEXPR :
-      lval_print_expr(v, '{', '}');
-      break;
-    case LVAL_SEXPR :
-      lval_print_expr(v, '(', ')');
-      break;
-    case LVAL_FUN   :
-      if (v->builtin) 
-      {
-        printf("<builtin>");
-      } 
-      else 
-      {
-        printf("(\\ "); lval_print(v->formals);
-        putchar(' '); lval_print(v->body); putchar(')');
-      }
-      break;
+    switch(LVAL_TYPE(v))
+    {
+      case LVAL_NUM   : 
+        printf("%li", LVAL_NUM_VAL(v)); 
+        break;
+      case LVAL_DBL   :
+        lval_print_dbl(LVAL_DBL_VAL(v), 1);
+        break;
+      case LVAL_ERR   : 
+        printf("Error : %s", v->err); 
+        break;
+      case LVAL_SYM   :
+        printf("%s", v->sym);
+        break;
+      case LVAL_STR   :
+        lval_print_str(v);
+        break;
+      case LVAL_QEXPR :
+        lval_print_expr(&s, &n, &cap, v, '{', '}');
+        break;
+      case LVAL_SEXPR :
+        lval_print_expr(&s, &n, &cap, v, '(', ')');
+        break;
+      case LVAL_CODE  :
+        lval_print_push(&s, &n, &cap, v->src, 0);
+        break;
+      case LVAL_MAP   :
+      case LVAL_PMAP  :
+        lval_print_map(&s, &n, &cap, v);
+        break;
+      case LVAL_VEC   :
+        lval_print_vec(v);
+        break;
+      case LVAL_FUN   :
+        if (LVAL_IS_BUILTIN(v)) 
+        {
+          printf("<builtin>");
+        } 
+        else 
+        {
+          printf("(\\ ");
+          lval_print_push(&s, &n, &cap, NULL, ')');
+          lval_print_push(&s, &n, &cap, v->body, 0);
+          lval_print_push(&s, &n, &cap, NULL, ' ');
+          lval_print_push(&s, &n, &cap, v->formals, 0);
+        }
+        break;
+    }
+    
+    /* Write out characters up to the next value */
+    while (n > 0 && !s[n-1].v) { putchar(s[--n].c); }
+    if (n == 0) { break; }
+    v = s[--n].v;
   }
+  
+  free(s);
 }
 
 void lval_println(lval* v) 
@@ -248,19 +970,6 @@ void lval_print_str(lval* v)
   free(escaped);
 }
 
-void lval_print_expr(lval* v, char open, char close)
-{
-  putchar(open);
-  for(int i = 0; i < v->count; i++)
-  {
-    lval_print(v->cell[i]);    
-    if (i != (v->count-1)) {
-      putchar(' ');
-    }
-  }
-  putchar(close);
-}
-
 char* ltype_name(int t)
 {
   switch(t) 
@@ -272,6 +981,14 @@ char* ltype_name(int t)
     case LVAL_STR: return "String";
     case LVAL_SEXPR: return "S-Expression";
     case LVAL_QEXPR: return "Q-Expression";
+    case LVAL_CELLS: return "Cells";
+    case LVAL_CODE: return "Code";
+    case LVAL_ENV: return "Environment";
+    case LVAL_MAP: return "Map";
+    case LVAL_PMAP: return "Persistent Map";
+    case LVAL_NODE: return "Node";
+    case LVAL_VEC: return "Vector";
+    case LVAL_DBL: return "Double";
     default: return "Unknown";
   }
   return "";
@@ -281,89 +998,148 @@ char* ltype_name(int t)
 
 /* #region LENV */
 
-lenv* lenv_new(void)
+/* Environments start out as plain arrays searched in order, which is
+   the fastest layout for the handful of arguments in a call frame. Once
+   one holds LENV_HASH_MIN symbols it switches to an open addressed hash
+   table of inline symbol/value slots, kept at most half full. Symbols
+   are interned, so a slot matches when its pointer does and the pointer
+   itself is hashed. */
+
+#define LENV_HASH_MIN 32
+
+unsigned long lenv_version = 1;
+
+static size_t lenv_hash(char* sym)
 {
-  lenv* e  = malloc(sizeof(lenv));
-  e->par   = NULL;
-  e->count = 0;
-  e->syms  = NULL;
-  e->vals  = NULL;
+  uint64_t h = (uint64_t)(uintptr_t)sym * 0x9E3779B97F4A7C15ull;
+  return (size_t)(h >> 32);
+}
+
+/* Find the slot for sym, either the one holding it or the empty slot
+   it would go in */
+static lslot* lenv_slot(lenv* e, char* sym)
+{
+  size_t mask = e->cap - 1;
+  size_t i    = lenv_hash(sym) & mask;
+  while (e->slots[i].sym && e->slots[i].sym != sym) { i = (i + 1) & mask; }
+  return &e->slots[i];
+}
+
+static void lenv_rehash(lenv* e, int cap)
+{
+  lslot* old   = e->slots;
+  int old_cap  = e->cap;
+  char** syms  = e->syms;
+  lval** vals  = e->vals;
   
-  return e;
+  e->slots = calloc(cap, sizeof(lslot));
+  e->cap   = cap;
+  
+  if (old_cap) {
+    for (int i = 0; i < old_cap; i++) {
+      if (old[i].sym) { *lenv_slot(e, old[i].sym) = old[i]; }
+    }
+    free(old);
+  } else {
+    for (int i = 0; i < e->count; i++) {
+      lslot* s = lenv_slot(e, syms[i]);
+      s->sym = syms[i];
+      s->val = vals[i];
+    }
+    free(syms);
+    free(vals);
+  }
 }
 
-void lenv_del(lenv* e)
+/* Where the value bound to sym lives in e, or NULL */
+static lval** lenv_find(lenv* e, char* sym)
 {
+  if (e->cap) {
+    lslot* s = lenv_slot(e, sym);
+    return s->sym ? &s->val : NULL;
+  }
+  
   for(int i = 0; i < e->count; i++)
   {
-    free(e->syms[i]);
-    lval_del(e->vals[i]);
+    if(e->syms[i] == sym) { return &e->vals[i]; }
   }
-  free(e->syms);
-  free(e->vals);
-  free(e);
+  return NULL;
 }
 
-lenv* lenv_copy(lenv* e)
+/* Only called once e->self is freed */
+void lenv_del(lenv* e)
 {
-  lenv* v  = malloc(sizeof(lenv));
-  v->count = e->count;
-  v->par   = e->par;
-  v->syms  = malloc(sizeof(char*) * v->count);
-  v->vals  = malloc(sizeof(lval*) * v->count);
-  
-  for(int i = 0; i < v->count; i++)
+  for(int i = 0; i < LENV_SIZE(e); i++)
   {
-    v->syms[i] = malloc(strlen(v->syms[i]) + 1);
-    strcpy(v->syms[i], e->syms[i]);
-    v->vals[i] = lval_copy(e->vals[i]);
+    if (LENV_VAL(e, i)) { lval_del(LENV_VAL(e, i)); }
   }
-  
-  return v;
+  if (e->cap) {
+    free(e->slots);
+  } else {
+    free(e->syms);
+    free(e->vals);
+  }
+  lenv_free(e);
 }
 
 lval* lenv_get(lenv* e, lval* v)
 {
-  for(int i = 0; i < e->count; i++)
+  lenv* found;
+  return lenv_get_from(e, v, &found);
+}
+
+/* lenv_get, also giving the environment v was found in, or NULL */
+lval* lenv_get_from(lenv* e, lval* v, lenv** found)
+{
+  for (; e; e = e->par)
   {
-    if(strcmp(v->sym, e->syms[i]) == 0)
-    {
-      return lval_copy(e->vals[i]);
-    }
+    lval** x = lenv_find(e, v->sym);
+    if (x) { *found = e; return lval_ref(*x); }
   }
   
-  if (e->par)
-  {
-    return lenv_get(e->par, v);
-  }
-  else
-  {
-    return lval_err("Unbound symbol '%s'", v->sym);
-  }
+  *found = NULL;
+  return lval_err("Unbound symbol '%s'", v->sym);
 }
 
 void lenv_put(lenv* e, lval* k, lval* v)
 {
   /* If the value with the same name exists
      Delete it and create a new one      */
-     
-  for(int i = 0; i < e->count; i++)
+  
+  lval** x = lenv_find(e, k->sym);
+  if (x)
   {
-    if(strcmp(e->syms[i], k->sym) == 0)
-    {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
-      return;
-    }
+    lval_del(*x);
+    *x = lval_ref(v);
+    return;
   }
   
   /* Create a new one otherwise */
+  if (e->cap == 0 && e->count + 1 >= LENV_HASH_MIN) {
+    lenv_rehash(e, 2 * LENV_HASH_MIN);
+  } else if (e->cap && 2 * (e->count + 1) > e->cap) {
+    lenv_rehash(e, 2 * e->cap);
+  }
+  
   e->count++;
-  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-  e->syms = realloc(e->syms, sizeof(char*) * e->count);  
-  e->vals[e->count-1] = lval_copy(v);
-  e->syms[e->count-1] = malloc(strlen(k->sym)+1);
-  strcpy(e->syms[e->count-1], k->sym);
+  
+  if (e->cap) {
+    lslot* s = lenv_slot(e, k->sym);
+    s->sym = k->sym;
+    s->val = lval_ref(v);
+    return;
+  }
+  
+  /* The arrays double from 4 as they fill, so that binding the arguments
+     of a call doesn't reallocate them for each one */
+  int n = e->count - 1;
+  if (n == 0 || (n >= 4 && (n & (n - 1)) == 0)) {
+    int cap = n ? 2 * n : 4;
+    e->vals = realloc(e->vals, sizeof(lval*) * cap);
+    e->syms = realloc(e->syms, sizeof(char*) * cap);
+  }
+  e->vals[e->count-1] = lval_ref(v);
+  e->syms[e->count-1] = k->sym;
 }
 
 void lenv_def(lenv* e, lval* k, lval* v)
@@ -0,0 +1,690 @@
+#include "lispy.h"
+
+/* Kernels behind LVAL_VEC.
+
+   A vector packs its numbers into one array of int64_t or of double
+   rather than a cell each, so going through one is a walk down memory
+   the CPU can take several numbers at a time. The kernels here do that
+   with SSE2 or AVX2 instructions, picked the first time one runs by
+   asking the CPU what it supports. Plain C loops cover everything else,
+   and are all that is built with -DLISPY_NO_SIMD.
+
+   Every kernel gives the same answer whichever instructions it uses,
+   down to the bits. The one exception is which NaN comes out of
+   adding two different ones, which C leaves to the compiler and which
+   prints the same. bench/vec_bench.c checks this.
+   Integer results leaving the 64 bit range are errors, as they are for
+   '+' and friends. Adding up doubles rounds differently depending on
+   the order, so sums always add element i into lane i % 4, then the
+   lanes together, then what is left over past the last 4, with vector
+   instructions or without. The same goes for the lowest and highest
+   double, which depend on the order once there is a NaN.
+
+   Not all of it vectorizes. There are no 64 bit integer multiply or
+   divide instructions, nor compares before AVX2, and each element of a
+   scan depends on the one before, so those stay plain loops. */
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) \
+  && !defined(LISPY_NO_SIMD)
+  #define LVEC_X86
+  #include <immintrin.h>
+  #define LVEC_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+enum { LVEC_PLAIN, LVEC_SSE2, LVEC_AVX2 };
+
+static char* lvec_names[] = { "plain", "sse2", "avx2" };
+
+static struct
+{
+  /* Knobs */
+  int limit;   /* highest level of instructions to use */
+
+  /* Level the CPU supports, -1 until asked */
+  int level;
+
+  /* Stats */
+  unsigned long calls;
+  unsigned long elements;
+} vec = { .limit = LVEC_AVX2, .level = -1 };
+
+static int lvec_level(void)
+{
+  if (vec.level < 0) {
+    vec.level = LVEC_PLAIN;
+#ifdef LVEC_X86
+    __builtin_cpu_init();
+    vec.level = __builtin_cpu_supports("avx2") ? LVEC_AVX2 : LVEC_SSE2;
+#endif
+  }
+  return vec.level < vec.limit ? vec.level : vec.limit;
+}
+
+/* Count a kernel call over n elements, and pick its instructions */
+static int lvec_start(int n)
+{
+  vec.calls++;
+  vec.elements += n;
+  return lvec_level();
+}
+
+/* Element i of an operand, which is a single number used for every
+   element when its stride s is 0 */
+#define LVEC_AT(p, s, i) ((p)[(s) ? (i) : 0])
+
+/* #region Arithmetic */
+
+static char* lvec_arith_int_plain(int op, int64_t* r, int64_t* x, int xs,
+  int64_t* y, int ys, int i, int n)
+{
+  for (; i < n; i++) {
+    int64_t a = LVEC_AT(x, xs, i);
+    int64_t b = LVEC_AT(y, ys, i);
+    switch (op) {
+      case LVEC_ADD:
+        if (__builtin_add_overflow(a, b, &r[i])) { return LOP_OVERFLOW; }
+        break;
+      case LVEC_SUB:
+        if (__builtin_sub_overflow(a, b, &r[i])) { return LOP_OVERFLOW; }
+        break;
+      case LVEC_MUL:
+        if (__builtin_mul_overflow(a, b, &r[i])) { return LOP_OVERFLOW; }
+        break;
+      case LVEC_DIV:
+        if (b == 0) { return LOP_DIV_ZERO; }
+        if (b == -1 && a == INT64_MIN) { return LOP_OVERFLOW; }
+        r[i] = a / b;
+        break;
+    }
+  }
+  return NULL;
+}
+
+static void lvec_arith_dbl_plain(int op, double* r, double* x, int xs,
+  double* y, int ys, int i, int n)
+{
+  for (; i < n; i++) {
+    double a = LVEC_AT(x, xs, i);
+    double b = LVEC_AT(y, ys, i);
+    switch (op) {
+      case LVEC_ADD: r[i] = a + b; break;
+      case LVEC_SUB: r[i] = a - b; break;
+      case LVEC_MUL: r[i] = a * b; break;
+      case LVEC_DIV: r[i] = a / b; break;
+    }
+  }
+}
+
+#ifdef LVEC_X86
+
+/* Integer add or subtract of the first n & ~3 elements. A lane overflowed
+   if the sign of c came out different from that of both operands when
+   adding, or of a when a and b differ in sign when subtracting. Those
+   sign bits are gathered in o, and the result is whether any was set */
+LVEC_TARGET_AVX2
+static int lvec_addsub_avx2(int sub, int64_t* r, int64_t* x, int xs,
+  int64_t* y, int ys, int n)
+{
+  __m256i o  = _mm256_setzero_si256();
+  __m256i bx = _mm256_set1_epi64x(*x);
+  __m256i by = _mm256_set1_epi64x(*y);
+  for (int i = 0; i + 4 <= n; i += 4) {
+    __m256i a = xs ? _mm256_loadu_si256((__m256i*)(x + i)) : bx;
+    __m256i b = ys ? _mm256_loadu_si256((__m256i*)(y + i)) : by;
+    __m256i c = sub ? _mm256_sub_epi64(a, b) : _mm256_add_epi64(a, b);
+    __m256i d = sub ? _mm256_xor_si256(a, b) : _mm256_xor_si256(b, c);
+    o = _mm256_or_si256(o, _mm256_and_si256(_mm256_xor_si256(a, c), d));
+    _mm256_storeu_si256((__m256i*)(r + i), c);
+  }
+  return _mm256_movemask_pd(_mm256_castsi256_pd(o));
+}
+
+/* The same for the first n & ~1 elements */
+static int lvec_addsub_sse2(int sub, int64_t* r, int64_t* x, int xs,
+  int64_t* y, int ys, int n)
+{
+  __m128i o  = _mm_setzero_si128();
+  __m128i bx = _mm_set1_epi64x(*x);
+  __m128i by = _mm_set1_epi64x(*y);
+  for (int i = 0; i + 2 <= n; i += 2) {
+    __m128i a = xs ? _mm_loadu_si128((__m128i*)(x + i)) : bx;
+    __m128i b = ys ? _mm_loadu_si128((__m128i*)(y + i)) : by;
+    __m128i c = sub ? _mm_sub_epi64(a, b) : _mm_add_epi64(a, b);
+    __m128i d = sub ? _mm_xor_si128(a, b) : _mm_xor_si128(b, c);
+    o = _mm_or_si128(o, _mm_and_si128(_mm_xor_si128(a, c), d));
+    _mm_storeu_si128((__m128i*)(r + i), c);
+  }
+  return _mm_movemask_pd(_mm_castsi128_pd(o));
+}
+
+/* Stamp out a loop applying step to a and b, W lanes at a time */
+#define LVEC_DBL_LOOP(W, T, load, set1, store, step)         \
+  {                                                          \
+    T bx = set1(*x);                                         \
+    T by = set1(*y);                                         \
+    for (int i = 0; i + W <= n; i += W) {                    \
+      T a = xs ? load(x + i) : bx;                           \
+      T b = ys ? load(y + i) : by;                           \
+      store(r + i, step(a, b));                              \
+    }                                                        \
+  }
+
+LVEC_TARGET_AVX2
+static void lvec_arith_dbl_avx2(int op, double* r, double* x, int xs,
+  double* y, int ys, int n)
+{
+  #define LVEC_AVX2_LOOP(step) \
+    LVEC_DBL_LOOP(4, __m256d, _mm256_loadu_pd, _mm256_set1_pd, \
+      _mm256_storeu_pd, step)
+  switch (op) {
+    case LVEC_ADD: LVEC_AVX2_LOOP(_mm256_add_pd); break;
+    case LVEC_SUB: LVEC_AVX2_LOOP(_mm256_sub_pd); break;
+    case LVEC_MUL: LVEC_AVX2_LOOP(_mm256_mul_pd); break;
+    case LVEC_DIV: LVEC_AVX2_LOOP(_mm256_div_pd); break;
+  }
+  #undef LVEC_AVX2_LOOP
+}
+
+static void lvec_arith_dbl_sse2(int op, double* r, double* x, int xs,
+  double* y, int ys, int n)
+{
+  #define LVEC_SSE2_LOOP(step) \
+    LVEC_DBL_LOOP(2, __m128d, _mm_loadu_pd, _mm_set1_pd, _mm_storeu_pd, step)
+  switch (op) {
+    case LVEC_ADD: LVEC_SSE2_LOOP(_mm_add_pd); break;
+    case LVEC_SUB: LVEC_SSE2_LOOP(_mm_sub_pd); break;
+    case LVEC_MUL: LVEC_SSE2_LOOP(_mm_mul_pd); break;
+    case LVEC_DIV: LVEC_SSE2_LOOP(_mm_div_pd); break;
+  }
+  #undef LVEC_SSE2_LOOP
+}
+
+#endif
+
+/* r[i] = x[i] op y[i] for n elements, where a stride xs or ys of 0
+   uses the single number x or y for every element. Returns an error
+   message, or NULL */
+char* lvec_arith_int(int op, int64_t* r, int64_t* x, int xs,
+  int64_t* y, int ys, int n)
+{
+  int level = lvec_start(n);
+  int i     = 0;
+#ifdef LVEC_X86
+  if (op == LVEC_ADD || op == LVEC_SUB) {
+    int sub = op == LVEC_SUB;
+    int o   = 0;
+    if (level == LVEC_AVX2) {
+      o = lvec_addsub_avx2(sub, r, x, xs, y, ys, n);
+      i = n & ~3;
+    } else if (level == LVEC_SSE2) {
+      o = lvec_addsub_sse2(sub, r, x, xs, y, ys, n);
+      i = n & ~1;
+    }
+    if (o) { return LOP_OVERFLOW; }
+  }
+#endif
+  (void)level;
+  return lvec_arith_int_plain(op, r, x, xs, y, ys, i, n);
+}
+
+void lvec_arith_dbl(int op, double* r, double* x, int xs,
+  double* y, int ys, int n)
+{
+  int level = lvec_start(n);
+  int i     = 0;
+#ifdef LVEC_X86
+  if (level == LVEC_AVX2) {
+    lvec_arith_dbl_avx2(op, r, x, xs, y, ys, n);
+    i = n & ~3;
+  } else if (level == LVEC_SSE2) {
+    lvec_arith_dbl_sse2(op, r, x, xs, y, ys, n);
+    i = n & ~1;
+  }
+#endif
+  (void)level;
+  lvec_arith_dbl_plain(op, r, x, xs, y, ys, i, n);
+}
+
+/* #endregion Arithmetic */
+
+/* #region Comparison */
+
+/* Comparisons give 1 where they hold and 0 elsewhere, as '==' does */
+
+static int lvec_holds(int op, double a, double b)
+{
+  switch (op) {
+    case LVEC_EQ: return a == b;
+    case LVEC_LT: return a < b;
+    case LVEC_GT: return a > b;
+    case LVEC_LE: return a <= b;
+    case LVEC_GE: return a >= b;
+  }
+  return 0;
+}
+
+static int lvec_holds_int(int op, int64_t a, int64_t b)
+{
+  switch (op) {
+    case LVEC_EQ: return a == b;
+    case LVEC_LT: return a < b;
+    case LVEC_GT: return a > b;
+    case LVEC_LE: return a <= b;
+    case LVEC_GE: return a >= b;
+  }
+  return 0;
+}
+
+#ifdef LVEC_X86
+
+/* Every comparison is a == b or a > b with the operands swapped
+   (swap) and the answer turned around (neg) as needed */
+LVEC_TARGET_AVX2
+static void lvec_compare_int_avx2(int op, int64_t* r, int64_t* x, int xs,
+  int64_t* y, int ys, int n)
+{
+  int eq   = op == LVEC_EQ;
+  int swap = op == LVEC_LT || op == LVEC_GE;
+  int neg  = op == LVEC_LE || op == LVEC_GE;
+
+  __m256i one = _mm256_set1_epi64x(1);
+  __m256i bx  = _mm256_set1_epi64x(*x);
+  __m256i by  = _mm256_set1_epi64x(*y);
+  for (int i = 0; i + 4 <= n; i += 4) {
+    __m256i a = xs ? _mm256_loadu_si256((__m256i*)(x + i)) : bx;
+    __m256i b = ys ? _mm256_loadu_si256((__m256i*)(y + i)) : by;
+    __m256i m = eq ? _mm256_cmpeq_epi64(a, b)
+      : swap ? _mm256_cmpgt_epi64(b, a) : _mm256_cmpgt_epi64(a, b);
+    m = neg ? _mm256_andnot_si256(m, one) : _mm256_and_si256(m, one);
+    _mm256_storeu_si256((__m256i*)(r + i), m);
+  }
+}
+
+#define LVEC_CMP_LOOP(W, T, load, set1, mask, step)                 \
+  {                                                                 \
+    T bx = set1(*x);                                                \
+    T by = set1(*y);                                                \
+    for (int i = 0; i + W <= n; i += W) {                           \
+      T a = xs ? load(x + i) : bx;                                  \
+      T b = ys ? load(y + i) : by;                                  \
+      mask(r + i, step);                                            \
+    }                                                               \
+  }
+
+LVEC_TARGET_AVX2
+static void lvec_mask_avx2(int64_t* r, __m256d m)
+{
+  __m256i one = _mm256_set1_epi64x(1);
+  _mm256_storeu_si256((__m256i*)r,
+    _mm256_and_si256(_mm256_castpd_si256(m), one));
+}
+
+static void lvec_mask_sse2(int64_t* r, __m128d m)
+{
+  __m128i one = _mm_set1_epi64x(1);
+  _mm_storeu_si128((__m128i*)r, _mm_and_si128(_mm_castpd_si128(m), one));
+}
+
+LVEC_TARGET_AVX2
+static void lvec_compare_dbl_avx2(int op, int64_t* r, double* x, int xs,
+  double* y, int ys, int n)
+{
+  #define LVEC_AVX2_LOOP(pred) \
+    LVEC_CMP_LOOP(4, __m256d, _mm256_loadu_pd, _mm256_set1_pd, \
+      lvec_mask_avx2, _mm256_cmp_pd(a, b, pred))
+  switch (op) {
+    case LVEC_EQ: LVEC_AVX2_LOOP(_CMP_EQ_OQ); break;
+    case LVEC_LT: LVEC_AVX2_LOOP(_CMP_LT_OQ); break;
+    case LVEC_GT: LVEC_AVX2_LOOP(_CMP_GT_OQ); break;
+    case LVEC_LE: LVEC_AVX2_LOOP(_CMP_LE_OQ); break;
+    case LVEC_GE: LVEC_AVX2_LOOP(_CMP_GE_OQ); break;
+  }
+  #undef LVEC_AVX2_LOOP
+}
+
+static void lvec_compare_dbl_sse2(int op, int64_t* r, double* x, int xs,
+  double* y, int ys, int n)
+{
+  #define LVEC_SSE2_LOOP(step) \
+    LVEC_CMP_LOOP(2, __m128d, _mm_loadu_pd, _mm_set1_pd, \
+      lvec_mask_sse2, step(a, b))
+  switch (op) {
+    case LVEC_EQ: LVEC_SSE2_LOOP(_mm_cmpeq_pd); break;
+    case LVEC_LT: LVEC_SSE2_LOOP(_mm_cmplt_pd); break;
+    case LVEC_GT: LVEC_SSE2_LOOP(_mm_cmpgt_pd); break;
+    case LVEC_LE: LVEC_SSE2_LOOP(_mm_cmple_pd); break;
+    case LVEC_GE: LVEC_SSE2_LOOP(_mm_cmpge_pd); break;
+  }
+  #undef LVEC_SSE2_LOOP
+}
+
+#endif
+
+void lvec_compare_int(int op, int64_t* r, int64_t* x, int xs,
+  int64_t* y, int ys, int n)
+{
+  int level = lvec_start(n);
+  int i     = 0;
+#ifdef LVEC_X86
+  if (level == LVEC_AVX2) {
+    lvec_compare_int_avx2(op, r, x, xs, y, ys, n);
+    i = n & ~3;
+  }
+#endif
+  (void)level;
+  for (; i < n; i++) {
+    r[i] = lvec_holds_int(op, LVEC_AT(x, xs, i), LVEC_AT(y, ys, i));
+  }
+}
+
+void lvec_compare_dbl(int op, int64_t* r, double* x, int xs,
+  double* y, int ys, int n)
+{
+  int level = lvec_start(n);
+  int i     = 0;
+#ifdef LVEC_X86
+  if (level == LVEC_AVX2) {
+    lvec_compare_dbl_avx2(op, r, x, xs, y, ys, n);
+    i = n & ~3;
+  } else if (level == LVEC_SSE2) {
+    lvec_compare_dbl_sse2(op, r, x, xs, y, ys, n);
+    i = n & ~1;
+  }
+#endif
+  (void)level;
+  for (; i < n; i++) {
+    r[i] = lvec_holds(op, LVEC_AT(x, xs, i), LVEC_AT(y, ys, i));
+  }
+}
+
+/* #endregion Comparison */
+
+/* #region Reduction */
+
+/* Integer sums go through the same 4 lanes as double ones, so which
+   partial sums can overflow doesn't depend on the instructions used */
+
+#ifdef LVEC_X86
+
+LVEC_TARGET_AVX2
+static int lvec_sum_int_avx2(int64_t* x, int n, int64_t* l)
+{
+  __m256i s = _mm256_setzero_si256();
+  __m256i o = _mm256_setzero_si256();
+  for (int i = 0; i + 4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((__m256i*)(x + i));
+    __m256i c = _mm256_add_epi64(s, a);
+    o = _mm256_or_si256(o, _mm256_and_si256(_mm256_xor_si256(s, c),
+      _mm256_xor_si256(a, c)));
+    s = c;
+  }
+  _mm256_storeu_si256((__m256i*)l, s);
+  return _mm256_movemask_pd(_mm256_castsi256_pd(o));
+}
+
+static int lvec_sum_int_sse2(int64_t* x, int n, int64_t* l)
+{
+  __m128i s[2] = { _mm_setzero_si128(), _mm_setzero_si128() };
+  __m128i o    = _mm_setzero_si128();
+  for (int i = 0; i + 4 <= n; i += 4) {
+    for (int j = 0; j < 2; j++) {
+      __m128i a = _mm_loadu_si128((__m128i*)(x + i + 2 * j));
+      __m128i c = _mm_add_epi64(s[j], a);
+      o = _mm_or_si128(o, _mm_and_si128(_mm_xor_si128(s[j], c),
+        _mm_xor_si128(a, c)));
+      s[j] = c;
+    }
+  }
+  _mm_storeu_si128((__m128i*)l, s[0]);
+  _mm_storeu_si128((__m128i*)(l + 2), s[1]);
+  return _mm_movemask_pd(_mm_castsi128_pd(o));
+}
+
+/* Lane sums of x, or of x[i] * y[i] when y isn't NULL */
+LVEC_TARGET_AVX2
+static void lvec_sum_dbl_avx2(double* x, double* y, int n, double* l)
+{
+  __m256d s = _mm256_setzero_pd();
+  for (int i = 0; i + 4 <= n; i += 4) {
+    __m256d a = _mm256_loadu_pd(x + i);
+    if (y) { a = _mm256_mul_pd(a, _mm256_loadu_pd(y + i)); }
+    s = _mm256_add_pd(s, a);
+  }
+  _mm256_storeu_pd(l, s);
+}
+
+static void lvec_sum_dbl_sse2(double* x, double* y, int n, double* l)
+{
+  __m128d s0 = _mm_setzero_pd();
+  __m128d s1 = _mm_setzero_pd();
+  for (int i = 0; i + 4 <= n; i += 4) {
+    __m128d a0 = _mm_loadu_pd(x + i);
+    __m128d a1 = _mm_loadu_pd(x + i + 2);
+    if (y) {
+      a0 = _mm_mul_pd(a0, _mm_loadu_pd(y + i));
+      a1 = _mm_mul_pd(a1, _mm_loadu_pd(y + i + 2));
+    }
+    s0 = _mm_add_pd(s0, a0);
+    s1 = _mm_add_pd(s1, a1);
+  }
+  _mm_storeu_pd(l, s0);
+  _mm_storeu_pd(l + 2, s1);
+}
+
+/* Lowest (max 0) or highest of x in 4 lanes, starting from its first 4.
+   MINPD gives its second operand unless the first is lower, and the
+   plain loop does the same */
+LVEC_TARGET_AVX2
+static void lvec_extreme_dbl_avx2(int max, double* x, int n, double* l)
+{
+  __m256d m = _mm256_loadu_pd(x);
+  for (int i = 4; i + 4 <= n; i += 4) {
+    __m256d a = _mm256_loadu_pd(x + i);
+    m = max ? _mm256_max_pd(m, a) : _mm256_min_pd(m, a);
+  }
+  _mm256_storeu_pd(l, m);
+}
+
+static void lvec_extreme_dbl_sse2(int max, double* x, int n, double* l)
+{
+  __m128d m0 = _mm_loadu_pd(x);
+  __m128d m1 = _mm_loadu_pd(x + 2);
+  for (int i = 4; i + 4 <= n; i += 4) {
+    __m128d a0 = _mm_loadu_pd(x + i);
+    __m128d a1 = _mm_loadu_pd(x + i + 2);
+    m0 = max ? _mm_max_pd(m0, a0) : _mm_min_pd(m0, a0);
+    m1 = max ? _mm_max_pd(m1, a1) : _mm_min_pd(m1, a1);
+  }
+  _mm_storeu_pd(l, m0);
+  _mm_storeu_pd(l + 2, m1);
+}
+
+/* Integer lowest or highest, which doesn't depend on the order */
+LVEC_TARGET_AVX2
+static void lvec_extreme_int_avx2(int max, int64_t* x, int n, int64_t* l)
+{
+  __m256i m = _mm256_loadu_si256((__m256i*)x);
+  for (int i = 4; i + 4 <= n; i += 4) {
+    __m256i a    = _mm256_loadu_si256((__m256i*)(x + i));
+    __m256i take = max ? _mm256_cmpgt_epi64(a, m) : _mm256_cmpgt_epi64(m, a);
+    m = _mm256_blendv_epi8(m, a, take);
+  }
+  _mm256_storeu_si256((__m256i*)l, m);
+}
+
+#endif
+
+char* lvec_sum_int(int64_t* x, int n, int64_t* out)
+{
+  int     level = lvec_start(n);
+  int64_t l[4]  = { 0, 0, 0, 0 };
+  int     o     = 0;
+  int     i     = n & ~3;
+
+  switch (level) {
+#ifdef LVEC_X86
+    case LVEC_AVX2: o = lvec_sum_int_avx2(x, n, l); break;
+    case LVEC_SSE2: o = lvec_sum_int_sse2(x, n, l); break;
+#endif
+    default:
+      for (int j = 0; j < i; j++) {
+        o |= __builtin_add_overflow(l[j % 4], x[j], &l[j % 4]);
+      }
+  }
+
+  int64_t a, b, s;
+  o |= __builtin_add_overflow(l[0], l[1], &a);
+  o |= __builtin_add_overflow(l[2], l[3], &b);
+  o |= __builtin_add_overflow(a, b, &s);
+  for (; i < n; i++) { o |= __builtin_add_overflow(s, x[i], &s); }
+
+  if (o) { return LOP_OVERFLOW; }
+  *out = s;
+  return NULL;
+}
+
+/* Sum of x, or of x[i] * y[i] when y isn't NULL */
+static double lvec_sum_dbl_lanes(double* x, double* y, int n)
+{
+  int    level = lvec_start(n);
+  double l[4]  = { 0, 0, 0, 0 };
+  int    i     = n & ~3;
+
+  switch (level) {
+#ifdef LVEC_X86
+    case LVEC_AVX2: lvec_sum_dbl_avx2(x, y, n, l); break;
+    case LVEC_SSE2: lvec_sum_dbl_sse2(x, y, n, l); break;
+#endif
+    default:
+      for (int j = 0; j < i; j++) { l[j % 4] += y ? x[j] * y[j] : x[j]; }
+  }
+
+  double s = (l[0] + l[1]) + (l[2] + l[3]);
+  for (; i < n; i++) { s += y ? x[i] * y[i] : x[i]; }
+  return s;
+}
+
+double lvec_sum_dbl(double* x, int n) { return lvec_sum_dbl_lanes(x, NULL, n); }
+
+double lvec_dot_dbl(double* x, double* y, int n)
+{
+  return lvec_sum_dbl_lanes(x, y, n);
+}
+
+/* Integer products overflow too often to leave to lanes, and there is
+   no instruction to multiply them in any case */
+char* lvec_dot_int(int64_t* x, int64_t* y, int n, int64_t* out)
+{
+  lvec_start(n);
+  int64_t s = 0;
+  for (int i = 0; i < n; i++) {
+    int64_t p;
+    if (__builtin_mul_overflow(x[i], y[i], &p)
+      || __builtin_add_overflow(s, p, &s))
+    {
+      return LOP_OVERFLOW;
+    }
+  }
+  *out = s;
+  return NULL;
+}
+
+static double lvec_pick(int max, double m, double a)
+{
+  return max ? (m > a ? m : a) : (m < a ? m : a);
+}
+
+/* The lowest (max 0) or highest of the n > 0 elements of x */
+double lvec_extreme_dbl(int max, double* x, int n)
+{
+  int    level = lvec_start(n);
+  double m     = x[0];
+  int    i     = 1;
+
+  if (n >= 4) {
+    double l[4] = { x[0], x[1], x[2], x[3] };
+    switch (level) {
+#ifdef LVEC_X86
+      case LVEC_AVX2: lvec_extreme_dbl_avx2(max, x, n, l); break;
+      case LVEC_SSE2: lvec_extreme_dbl_sse2(max, x, n, l); break;
+#endif
+      default:
+        for (int j = 4; j < (n & ~3); j++) {
+          l[j % 4] = lvec_pick(max, l[j % 4], x[j]);
+        }
+    }
+    m = lvec_pick(max, lvec_pick(max, l[0], l[1]), lvec_pick(max, l[2], l[3]));
+    i = n & ~3;
+  }
+
+  for (; i < n; i++) { m = lvec_pick(max, m, x[i]); }
+  return m;
+}
+
+int64_t lvec_extreme_int(int max, int64_t* x, int n)
+{
+  int     level = lvec_start(n);
+  int64_t m     = x[0];
+  int     i     = 1;
+#ifdef LVEC_X86
+  if (level == LVEC_AVX2 && n >= 4) {
+    int64_t l[4];
+    lvec_extreme_int_avx2(max, x, n, l);
+    for (int j = 0; j < 4; j++) {
+      if (max ? l[j] > m : l[j] < m) { m = l[j]; }
+    }
+    i = n & ~3;
+  }
+#endif
+  (void)level;
+  for (; i < n; i++) {
+    if (max ? x[i] > m : x[i] < m) { m = x[i]; }
+  }
+  return m;
+}
+
+/* #endregion Reduction */
+
+/* #region Scan */
+
+/* Running sums, r[i] being the sum of x[0..i] */
+
+char* lvec_scan_int(int64_t* r, int64_t* x, int n)
+{
+  lvec_start(n);
+  int64_t s = 0;
+  for (int i = 0; i < n; i++) {
+    if (__builtin_add_overflow(s, x[i], &s)) { return LOP_OVERFLOW; }
+    r[i] = s;
+  }
+  return NULL;
+}
+
+void lvec_scan_dbl(double* r, double* x, int n)
+{
+  lvec_start(n);
+  double s = 0;
+  for (int i = 0; i < n; i++) { r[i] = s += x[i]; }
+}
+
+/* #endregion Scan */
+
+/* Knobs and stats */
+
+int lvec_set(char* knob, long value)
+{
+  if (value < 0) { return 0; }
+
+  if (strcmp(knob, "level") == 0) {
+    vec.limit = value < LVEC_AVX2 ? value : LVEC_AVX2;
+    return 1;
+  }
+  return 0;
+}
+
+void lvec_print(void)
+{
+  int level = lvec_level();
+  printf("vec : %s kernels (%s supported), %lu calls over %lu elements\n",
+    lvec_names[level], lvec_names[vec.level], vec.calls, vec.elements);
+}
@@ -0,0 +1,993 @@
+#include "lispy.h"
+
+/* Bytecode compiler and the evaluator.
+
+   The tree walking evaluator rebuilds an expression every time it runs
+   it: each S-Expression is copied before its cells are replaced by their
+   values, and 'if' copies the branch it takes to turn it into an
+   S-Expression. A lambda body never changes, so lval_lambda compiles it
+   once into a flat program for a stack machine, and calls run that
+   instead. Code built at runtime and passed to 'eval' is still walked.
+
+   The compiler only knows the shape of the code, never what a symbol
+   is bound to, since any binding can change between two calls. So an
+   S-Expression compiles to the code pushing each of its cells followed
+   by a call that checks them just like lvm_walk does. The one exception
+   is 'if' with two literal branches, which compiles to a conditional
+   jump around the code for each branch. That code only runs after
+   checking that 'if' is still the builtin, otherwise whatever it is
+   bound to is called with the branches as arguments.
+
+   Symbols that name a formal of the lambda load its slot of the frame
+   directly, see lvm_slot.
+
+   Arithmetic and comparisons on literal numbers, like (* 60 60 24), are
+   worked out by the compiler, as is the branch an 'if' with such a
+   condition takes. The result only holds while the operators are still
+   the builtins, so the code checks that first, the same way an inline
+   cache does, and runs the code for the whole expression when they
+   are not.
+
+   Every other symbol gets an inline cache of its own. A lookup that ends
+   in the global environment is remembered along with lenv_version, and
+   until that changes the next lookup from the same place is a compare.
+   The frames searched before the global one are those of the lambda
+   and the environment it closes over, which is fixed once compiled. A
+   new frame only binds formals, which never get here, so nothing can
+   come between the symbol and its global binding without a 'def' or
+   '=' bumping the version.
+
+   Neither walking nor running code recurses in C. Evaluating an
+   S-Expression or calling a lambda pushes a frame on a stack of our own
+   and the loop in lvm_loop carries on with it, so nesting is bounded by
+   memory and by the depth limit, never by the C stack. Only builtins
+   that evaluate, like 'load', enter the loop again. Past the limit the
+   evaluation fails with an error rather than taking the process down.
+
+   A call in tail position replaces the frame that makes it rather than
+   pushing another, so iterating by recursion takes constant space. That
+   includes a call at the end of the expression given to 'eval' or 'if'.
+   The environment of the caller goes with its frame unless a lambda
+   made in it still closes over it. */
+
+enum
+{
+  OP_CONST,  /* k           push constant k */
+  OP_LOAD,   /* k ic        push the value of symbol k, through cache ic */
+  OP_LOCAL,  /* slot k      same, from the frame if symbol k is in the slot */
+  OP_NIL,    /*             push an empty S-Expression */
+  OP_EVAL,   /*             evaluate the value on top again */
+  OP_CALL,   /* n           call the top n values, the function first */
+  OP_TAIL,   /* n           same, in tail position */
+  OP_IF,     /* ka kb j end pop the condition and 'if', jump to j if false */
+  OP_JUMP,   /* j */
+  OP_FOLD,   /* f j         if fold f holds push its value and jump to j */
+  OP_RET     /*             return the value on top */
+};
+
+/* The value a symbol was last found to have globally, valid as long as
+   version is lenv_version. The cache holds on to val, or NULL, so a
+   stale one never points to a value that was freed */
+typedef struct lcache
+{
+  unsigned long version;
+  lval*         val;
+} lcache;
+
+/* An expression worked out by the compiler. It holds as long as each
+   of its operators checks[first..first + n) is still bound globally to
+   the builtin it was worked out with, which was last checked when
+   lenv_version was version. The value is always a number, or NULL for
+   the condition of an 'if' */
+typedef struct lcheck
+{
+  lval*    sym;
+  lbuiltin fn;
+} lcheck;
+
+typedef struct lfold
+{
+  unsigned long version;
+  int           holds;
+  lval*         val;
+  int           first;
+  int           n;
+} lfold;
+
+struct lcode
+{
+  int*   ops;
+  int    nops;
+  int    cap;
+
+  /* Constants are borrowed from the source, which outlives the code */
+  lval** consts;
+  int    nconsts;
+  int    kcap;
+
+  lcache* caches;
+  int     ncaches;
+
+  lfold*  folds;
+  int     nfolds;
+  int     fcap;
+  lcheck* checks;
+  int     nchecks;
+  int     ccap;
+
+  /* Formals of the lambda the slots were worked out for */
+  lval*  formals;
+
+  /* Stack slots needed, and used so far while compiling */
+  int    stack;
+  int    depth;
+
+  /* S-Expressions entered while compiling, and folds being compiled
+     the long way */
+  int    nest;
+  int    plain;
+
+  /* Calls so far, and the native code once there were enough */
+  unsigned int calls;
+  ljit*  jit;
+};
+
+/* A frame runs code when c is set, otherwise it walks v */
+typedef struct lframe
+{
+  lval*  env;   /* LVAL_ENV of e if the frame holds it, or NULL */
+  lenv*  e;
+  lval*  code;  /* LVAL_CODE of c */
+  lcode* c;
+  int*   pc;
+  lval*  v;     /* S-Expression whose cells before i are evaluated */
+  int    i;
+  int    base;  /* value stack height when the frame started */
+} lframe;
+
+/* The value stack shared by every running body and the frame stack.
+   Both grow as calls nest, so only ever refer to them through vm */
+static struct
+{
+  lval**  stack;
+  int     sp;
+  int     cap;
+  lframe* frames;
+  int     nframes;
+  int     fcap;
+
+  /* Knobs */
+  unsigned long limit;  /* most frames at once, 0 for no limit */
+
+  /* Stats */
+  int     deepest;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long folded;
+} vm = { .limit = 100000 };
+
+/* #region Compiler */
+
+static int lvm_emit(lcode* c, int op)
+{
+  if (c->nops == c->cap)
+  {
+    c->cap = c->cap ? c->cap * 2 : 16;
+    c->ops = realloc(c->ops, sizeof(int) * c->cap);
+  }
+  c->ops[c->nops] = op;
+  return c->nops++;
+}
+
+static int lvm_const(lcode* c, lval* k)
+{
+  if (c->nconsts == c->kcap)
+  {
+    c->kcap   = c->kcap ? c->kcap * 2 : 8;
+    c->consts = realloc(c->consts, sizeof(lval*) * c->kcap);
+  }
+  c->consts[c->nconsts] = k;
+  return c->nconsts++;
+}
+
+static void lvm_depth(lcode* c, int n)
+{
+  c->depth += n;
+  if (c->depth > c->stack) { c->stack = c->depth; }
+}
+
+static void lvm_sexpr(lcode* c, lval* v, int tail);
+
+/* Lexical addressing. Arguments are bound into a lambda's frame in the
+   order of its formals, so a symbol naming a formal has a slot there
+   that the code can read without searching the frame. Returns -1 for
+   any other symbol. The slot belongs to the code and not the symbol,
+   since the same body can be shared by lambdas with other formals */
+int lvm_slot(lval* formals, char* sym)
+{
+  for (int i = 0, slot = 0; i < formals->count; i++) {
+    char* s = formals->cell[i]->sym;
+    if (s == lsym_rest) { continue; }
+    if (s == sym) { return slot; }
+    slot++;
+  }
+  return -1;
+}
+
+/* Code pushing the value of v */
+static void lvm_expr(lcode* c, lval* v)
+{
+  switch (LVAL_TYPE(v)) {
+    case LVAL_SEXPR:
+      if (c->nest < LVM_NEST_MAX) {
+        lvm_sexpr(c, v, 0);
+        return;
+      }
+      lvm_emit(c, OP_CONST);
+      lvm_emit(c, lvm_const(c, v));
+      lvm_emit(c, OP_EVAL);
+      break;
+    case LVAL_SYM: {
+      int slot = lvm_slot(c->formals, v->sym);
+      if (slot >= 0) {
+        lvm_emit(c, OP_LOCAL);
+        lvm_emit(c, slot);
+        lvm_emit(c, lvm_const(c, v));
+      } else {
+        lvm_emit(c, OP_LOAD);
+        lvm_emit(c, lvm_const(c, v));
+        lvm_emit(c, c->ncaches++);
+      }
+      break;
+    }
+    default:
+      lvm_emit(c, OP_CONST);
+      lvm_emit(c, lvm_const(c, v));
+      break;
+  }
+  lvm_depth(c, 1);
+}
+
+static int lvm_is_if(lval* v)
+{
+  return v->count == 4
+    && LVAL_TYPE(v->cell[0]) == LVAL_SYM && v->cell[0]->sym == lsym_if
+    && LVAL_TYPE(v->cell[2]) == LVAL_QEXPR
+    && LVAL_TYPE(v->cell[3]) == LVAL_QEXPR;
+}
+
+/* Builtins that only work out a value from their arguments */
+static const struct { char* name; lbuiltin fn; } lvm_pure[] = {
+  { "+",  builtin_add }, { "-",  builtin_sub }, { "*",  builtin_mul },
+  { "/",  builtin_div }, { "%",  builtin_mod },
+  { ">",  builtin_gt  }, { "<",  builtin_lt  }, { ">=", builtin_ge  },
+  { "<=", builtin_le  }, { "==", builtin_eq  }, { "!=", builtin_ne  },
+};
+
+static lbuiltin lvm_pure_fn(lcode* c, lval* v)
+{
+  if (LVAL_TYPE(v) != LVAL_SYM || lvm_slot(c->formals, v->sym) >= 0) {
+    return NULL;
+  }
+  for (int i = 0; i < (int)(sizeof(lvm_pure) / sizeof(lvm_pure[0])); i++) {
+    if (strcmp(v->sym, lvm_pure[i].name) == 0) { return lvm_pure[i].fn; }
+  }
+  return NULL;
+}
+
+static void lvm_check(lcode* c, lval* sym, lbuiltin fn)
+{
+  if (c->nchecks == c->ccap)
+  {
+    c->ccap   = c->ccap ? c->ccap * 2 : 8;
+    c->checks = realloc(c->checks, sizeof(lcheck) * c->ccap);
+  }
+  c->checks[c->nchecks].sym = sym;
+  c->checks[c->nchecks].fn  = fn;
+  c->nchecks++;
+}
+
+static int lvm_fold(lcode* c, lval* val, int first)
+{
+  if (c->nfolds == c->fcap)
+  {
+    c->fcap  = c->fcap ? c->fcap * 2 : 4;
+    c->folds = realloc(c->folds, sizeof(lfold) * c->fcap);
+  }
+  lfold* fd   = &c->folds[c->nfolds];
+  fd->version = 0;
+  fd->holds   = 0;
+  fd->val     = val;
+  fd->first   = first;
+  fd->n       = c->nchecks - first;
+  return c->nfolds++;
+}
+
+static lval* lvm_fold_value(lcode* c, lval* v, int nest);
+
+/* The value of the cells of v evaluated as an S-Expression, if they
+   only do arithmetic or comparisons on literal numbers or doubles
+   without an error, adding the operators they need to the checks.
+   Otherwise NULL */
+static lval* lvm_fold_cells(lcode* c, lval* v, int nest)
+{
+  if (v->count < 2 || nest >= LVM_NEST_MAX) { return NULL; }
+
+  lbuiltin fn = lvm_pure_fn(c, v->cell[0]);
+  if (!fn) { return NULL; }
+
+  lval* a = lval_sexpr();
+  for (int i = 1; i < v->count; i++) {
+    lval* x = lvm_fold_value(c, v->cell[i], nest + 1);
+    if (!x) {
+      lval_del(a);
+      return NULL;
+    }
+    lval_add(a, x);
+  }
+
+  lval* r = fn(NULL, a);
+  if (LVAL_TYPE(r) != LVAL_NUM && LVAL_TYPE(r) != LVAL_DBL) {
+    lval_del(r);
+    return NULL;
+  }
+  lvm_check(c, v->cell[0], fn);
+  return r;
+}
+
+/* The same for a cell, which can also be a literal number */
+static lval* lvm_fold_value(lcode* c, lval* v, int nest)
+{
+  switch (LVAL_TYPE(v)) {
+    case LVAL_NUM:
+    case LVAL_DBL:   return lval_ref(v);
+    case LVAL_SEXPR: return lvm_fold_cells(c, v, nest);
+  }
+  return NULL;
+}
+
+static void lvm_sexpr_cells(lcode* c, lval* v, int tail);
+
+/* Code for v worked out ahead, followed by the code for all of it that
+   runs when the fold doesn't hold. Returns 0 if v can't be folded */
+static int lvm_sexpr_fold(lcode* c, lval* v, int tail)
+{
+  int   first = c->nchecks;
+  lval* k     = NULL;
+  lval* cond  = NULL;
+
+  if (c->nest < LVM_NEST_MAX && lvm_is_if(v)
+    && lvm_slot(c->formals, v->cell[0]->sym) < 0) {
+    cond = lvm_fold_value(c, v->cell[1], 0);
+    
+    /* 'if' only takes a Number, and reports anything else when run */
+    if (cond && LVAL_TYPE(cond) != LVAL_NUM) {
+      lval_del(cond);
+      cond = NULL;
+    }
+    if (cond) { lvm_check(c, v->cell[0], builtin_if); }
+  } else {
+    k = lvm_fold_cells(c, v, 0);
+  }
+
+  if (!k && !cond) {
+    c->nchecks = first;
+    return 0;
+  }
+  vm.folded++;
+
+  int at = lvm_emit(c, OP_FOLD);
+  lvm_emit(c, lvm_fold(c, k, first));
+  lvm_emit(c, 0);
+
+  c->plain++;
+  lvm_sexpr_cells(c, v, tail);
+  c->plain--;
+
+  if (k) {
+    c->ops[at + 2] = c->nops;
+    return 1;
+  }
+
+  /* Only the branch taken is left */
+  long t = LVAL_NUM_VAL(cond);
+  lval_del(cond);
+
+  lvm_depth(c, -1);
+  int jump = lvm_emit(c, OP_JUMP);
+  lvm_emit(c, 0);
+  c->ops[at + 2] = c->nops;
+  lvm_sexpr(c, t ? v->cell[2] : v->cell[3], tail);
+  c->ops[jump + 1] = c->nops;
+  return 1;
+}
+
+/* Code pushing the value of the cells of v evaluated as an S-Expression */
+static void lvm_sexpr_cells(lcode* c, lval* v, int tail)
+{
+  if (v->count == 0) {
+    lvm_emit(c, OP_NIL);
+    lvm_depth(c, 1);
+    return;
+  }
+
+  /* A single cell is evaluated a second time, which only changes
+     symbols and S-Expressions */
+  if (v->count == 1) {
+    lvm_expr(c, v->cell[0]);
+    int t = LVAL_TYPE(v->cell[0]);
+    if (t == LVAL_SYM || t == LVAL_SEXPR) { lvm_emit(c, OP_EVAL); }
+    return;
+  }
+
+  if (!c->plain && lvm_sexpr_fold(c, v, tail)) { return; }
+
+  if (c->nest < LVM_NEST_MAX && lvm_is_if(v)) {
+    lvm_expr(c, v->cell[0]);
+    lvm_expr(c, v->cell[1]);
+    int at = lvm_emit(c, OP_IF);
+    lvm_emit(c, lvm_const(c, v->cell[2]));
+    lvm_emit(c, lvm_const(c, v->cell[3]));
+    lvm_emit(c, 0);
+    lvm_emit(c, 0);
+
+    /* Calling something else pushes the branches as well */
+    lvm_depth(c, 2);
+    lvm_depth(c, -4);
+
+    lvm_sexpr(c, v->cell[2], tail);
+    lvm_depth(c, -1);
+    int jump = lvm_emit(c, OP_JUMP);
+    lvm_emit(c, 0);
+
+    c->ops[at + 3] = c->nops;
+    lvm_sexpr(c, v->cell[3], tail);
+    c->ops[at + 4] = c->ops[jump + 1] = c->nops;
+    return;
+  }
+
+  for (int i = 0; i < v->count; i++) { lvm_expr(c, v->cell[i]); }
+  lvm_emit(c, tail ? OP_TAIL : OP_CALL);
+  lvm_emit(c, v->count);
+  lvm_depth(c, 1 - v->count);
+}
+
+static void lvm_sexpr(lcode* c, lval* v, int tail)
+{
+  c->nest++;
+  lvm_sexpr_cells(c, v, tail);
+  c->nest--;
+}
+
+/* Compile a lambda body, taking over the reference to it. The code
+   holds on to formals too, see lvm_native */
+lval* lvm_compile(lval* body, lval* formals)
+{
+  lcode* c   = calloc(1, sizeof(lcode));
+  c->formals = lval_ref(formals);
+  lvm_sexpr(c, body, 1);
+  lvm_emit(c, OP_RET);
+  c->caches = calloc(c->ncaches, sizeof(lcache));
+
+  lval* v  = lval_alloc();
+  v->type  = LVAL_CODE;
+  v->flags = 0;
+  v->refs  = 1;
+  v->src   = body;
+  v->code  = c;
+  return v;
+}
+
+lval* lvm_formals(lcode* c) { return c->formals; }
+int   lvm_ncaches(lcode* c) { return c->ncaches; }
+lval* lvm_cache(lcode* c, int i) { return c->caches[i].val; }
+
+void lvm_free(lcode* c)
+{
+  lval_del(c->formals);
+  free(c->ops);
+  free(c->consts);
+  for (int i = 0; i < c->ncaches; i++) {
+    if (c->caches[i].val) { lval_del(c->caches[i].val); }
+  }
+  free(c->caches);
+  for (int i = 0; i < c->nfolds; i++) {
+    if (c->folds[i].val) { lval_del(c->folds[i].val); }
+  }
+  free(c->folds);
+  free(c->checks);
+  if (c->jit) { ljit_free(c->jit); }
+  free(c);
+}
+
+/* #endregion Compiler */
+
+/* #region Virtual Machine */
+
+static void lvm_reserve(int n)
+{
+  if (vm.sp + n <= vm.cap) { return; }
+  while (vm.sp + n > vm.cap) { vm.cap = vm.cap ? vm.cap * 2 : 256; }
+  vm.stack = realloc(vm.stack, sizeof(lval*) * vm.cap);
+}
+
+static void  lvm_push(lval* x) { vm.stack[vm.sp++] = x; }
+static lval* lvm_pop(void)     { return vm.stack[--vm.sp]; }
+
+static lframe* lvm_top(void) { return &vm.frames[vm.nframes - 1]; }
+
+/* Push a frame evaluating in e, or return NULL if there are too many.
+   Frames move when there are more of them, so a pointer to one is only
+   good until the next frame is pushed */
+static lframe* lvm_frame(lenv* e)
+{
+  if (vm.limit && (unsigned long)vm.nframes >= vm.limit) { return NULL; }
+
+  if (vm.nframes == vm.fcap)
+  {
+    vm.fcap   = vm.fcap ? vm.fcap * 2 : 64;
+    vm.frames = realloc(vm.frames, sizeof(lframe) * vm.fcap);
+  }
+
+  lframe* fr = &vm.frames[vm.nframes++];
+  if (vm.nframes > vm.deepest) { vm.deepest = vm.nframes; }
+  fr->env  = NULL;
+  fr->e    = e;
+  fr->code = NULL;
+  fr->c    = NULL;
+  fr->pc   = NULL;
+  fr->v    = NULL;
+  fr->i    = 0;
+  fr->base = vm.sp;
+  return fr;
+}
+
+static lval* lvm_too_deep(void)
+{
+  return lval_err("Maximum evaluation depth of %lu exceeded.", vm.limit);
+}
+
+/* Drop what fr holds on to */
+static void lvm_release(lframe* fr)
+{
+  if (fr->env)  { lval_del(fr->env); }
+  if (fr->code) { lval_del(fr->code); }
+  fr->env  = NULL;
+  fr->code = NULL;
+  fr->c    = NULL;
+}
+
+/* Make fr run the body of f in the frame env, see lval_bind. Takes over
+   the reference to env */
+static void lvm_start(lframe* fr, lval* f, lval* env)
+{
+  fr->env  = env;
+  fr->e    = env->vars;
+  fr->code = lval_ref(f->body);
+  fr->c    = fr->code->code;
+  fr->pc   = fr->c->ops;
+  fr->v    = NULL;
+  lvm_reserve(fr->c->stack + 1);
+}
+
+/* Pop the values of the n cells of an S-Expression and check them like
+   lvm_walk does. Returns the error to push in their place, or NULL with
+   the function in f and an S-Expression of its arguments in a */
+static lval* lvm_args(int n, lval** f, lval** a)
+{
+  vm.sp -= n;
+  lval** x = vm.stack + vm.sp;
+
+  for (int i = 0; i < n; i++) {
+    if (LVAL_TYPE(x[i]) != LVAL_ERR) { continue; }
+    for (int j = 0; j < n; j++) {
+      if (j != i) { lval_del(x[j]); }
+    }
+    return x[i];
+  }
+
+  if (LVAL_TYPE(x[0]) != LVAL_FUN) {
+    lval* err = lval_err(
+      "S-Expression starts with incorrect type. "
+      "Got %s, Expected %s.",
+      ltype_name(LVAL_TYPE(x[0])), ltype_name(LVAL_FUN));
+    for (int j = 0; j < n; j++) { lval_del(x[j]); }
+    return err;
+  }
+
+  *f = x[0];
+  *a = lval_sexpr_of(x + 1, n - 1);
+  return NULL;
+}
+
+/* The value of x in e, or NULL once a frame evaluating it is pushed. Its
+   value then goes to the frame below when it is done */
+static lval* lvm_value(lenv* e, lval* x)
+{
+  if (LVAL_TYPE(x) == LVAL_SYM) {
+    lval* r = lenv_get(e, x);
+    lval_del(x);
+    return r;
+  }
+  if (LVAL_TYPE(x) != LVAL_SEXPR) { return x; }
+
+  lframe* fr = lvm_frame(e);
+  if (!fr) {
+    lval_del(x);
+    return lvm_too_deep();
+  }
+
+  /* Cells are replaced by their values, so it can't be shared */
+  fr->v = lval_unshare(x);
+  return NULL;
+}
+
+/* The same for x in tail position, where fr carries on evaluating it
+   instead of pushing a frame */
+static lval* lvm_value_tail(lframe* fr, lval* x)
+{
+  if (LVAL_TYPE(x) != LVAL_SEXPR) { return lvm_value(fr->e, x); }
+
+  /* Only the environment is still needed */
+  if (fr->code) {
+    lval_del(fr->code);
+    fr->code = NULL;
+    fr->c    = NULL;
+  }
+  fr->v = lval_unshare(x);
+  fr->i = 0;
+  return NULL;
+}
+
+/* The value of the lambda g applied to a by its native code, compiling
+   it once g is called often enough. NULL if it has to be interpreted */
+static lval* lvm_native(lval* g, lval* a)
+{
+  lcode* c = g->body->code;
+
+  /* A partial application shares the code of the lambda it was made
+     from, but not the formals the slots were worked out for */
+  if (g->formals != c->formals) { return NULL; }
+  if (!c->jit) {
+    if (!ljit_hot(&c->calls)) { return NULL; }
+    c->jit = ljit_compile(g);
+    if (!c->jit) { return NULL; }
+  }
+
+  /* Native calls count against the depth limit like frames do */
+  long budget = vm.limit ? (long)vm.limit - vm.nframes - 1 : LONG_MAX;
+  return ljit_run(c->jit, g, a, budget);
+}
+
+/* Apply g to the arguments a like lval_call, in the environment of fr.
+   Returns the result, or NULL once a frame is evaluating it */
+static lval* lvm_apply(lframe* fr, lval* g, lval* a, int tail)
+{
+  lenv* e = fr->e;
+
+  if (LVAL_IS_BUILTIN(g)) {
+    lbuiltin b = g->builtin;
+    lval_del(g);
+
+    /* These two evaluate an expression of ours, which goes on here rather
+       than in a nested lval_eval */
+    if (b == builtin_if || b == builtin_eval) {
+      lval* x = b == builtin_if ? builtin_if_expr(a) : builtin_eval_expr(a);
+      return tail ? lvm_value_tail(fr, x) : lvm_value(e, x);
+    }
+    return b(e, a);
+  }
+
+  lval* x = lvm_native(g, a);
+  if (x) {
+    lval_del(g);
+    return x;
+  }
+
+  x = lval_bind(g, a);
+  if (LVAL_TYPE(x) != LVAL_ENV) {
+    lval_del(g);
+    return x;
+  }
+
+  /* Nothing can refer to a frame of ours that a lambda doesn't hold on
+     to, so a tail call simply replaces it */
+  if (tail) {
+    lvm_release(fr);
+    lvm_start(fr, g, x);
+    lval_del(g);
+    return NULL;
+  }
+
+  lframe* next = lvm_frame(x->vars);
+  if (!next) {
+    lval_del(x);
+    lval_del(g);
+    return lvm_too_deep();
+  }
+  lvm_start(next, g, x);
+  lval_del(g);
+  return NULL;
+}
+
+/* Evaluate the cells of fr->v one at a time, then apply the first to
+   the rest. Returns the value of fr, or NULL when the frames changed */
+static lval* lvm_walk(lframe* fr)
+{
+  lval* v = fr->v;
+
+  while (fr->i < v->count) {
+    lgc_poll();
+
+    /* The cell is handed over, don't leave it behind for the garbage
+       collector to find while it is being evaluated */
+    lval* x = v->cell[fr->i];
+    v->cell[fr->i] = NULL;
+
+    x = lvm_value(fr->e, x);
+    if (!x) { return NULL; }
+    v->cell[fr->i++] = x;
+    if (!LVAL_IS_FIXNUM(x)) { v->flags &= ~LVAL_PACKED; }
+  }
+
+  fr->v = NULL;
+
+  for (int i = 0; i < v->count; i++) {
+    if (LVAL_TYPE(v->cell[i]) == LVAL_ERR) { return lval_take(v, i); }
+  }
+
+  if (v->count == 0) { return v; }
+  if (v->count == 1) { return lvm_value_tail(fr, lval_take(v, 0)); }
+
+  lval* g = lval_pop(v, 0);
+  if (LVAL_TYPE(g) != LVAL_FUN) {
+    lval* err = lval_err(
+      "S-Expression starts with incorrect type. "
+      "Got %s, Expected %s.",
+      ltype_name(LVAL_TYPE(g)), ltype_name(LVAL_FUN));
+    lval_del(g); lval_del(v);
+    return err;
+  }
+
+  return lvm_apply(fr, g, v, 1);
+}
+
+/* Whether the operators of fd are still bound globally to the builtins
+   it was worked out with */
+static int lvm_holds(lenv* e, lcode* c, lfold* fd)
+{
+  for (int i = fd->first; i < fd->first + fd->n; i++) {
+    lenv* found;
+    lval* x  = lenv_get_from(e, c->checks[i].sym, &found);
+    int   ok = found && !found->par && LVAL_TYPE(x) == LVAL_FUN
+      && LVAL_IS_BUILTIN(x) && x->builtin == c->checks[i].fn;
+    lval_del(x);
+    if (!ok) { return 0; }
+  }
+  return 1;
+}
+
+/* Run the code of fr. Returns the value of fr, or NULL when the frames
+   changed. fr->pc is saved before anything that can push a frame */
+static lval* lvm_exec(lframe* fr)
+{
+  lenv*  e  = fr->e;
+  lcode* c  = fr->c;
+  int*   pc = fr->pc;
+
+  for (;;) {
+    switch (*pc++) {
+      case OP_CONST:
+        lvm_push(lval_ref(c->consts[*pc++]));
+        break;
+
+      case OP_LOAD: {
+        lval*   sym = c->consts[*pc++];
+        lcache* ic  = &c->caches[*pc++];
+        if (ic->version == lenv_version) {
+          vm.hits++;
+          lvm_push(lval_ref(ic->val));
+          break;
+        }
+
+        vm.misses++;
+        lenv* found;
+        lval* x = lenv_get_from(e, sym, &found);
+        if (found && !found->par) {
+          if (ic->val) { lval_del(ic->val); }
+          ic->version = lenv_version;
+          ic->val     = lval_ref(x);
+        }
+        lvm_push(x);
+        break;
+      }
+
+      case OP_LOCAL: {
+        int   slot = *pc++;
+        lval* sym  = c->consts[*pc++];
+        if (!e->cap && slot < e->count && e->syms[slot] == sym->sym) {
+          lvm_push(lval_ref(e->vals[slot]));
+        } else {
+          lvm_push(lenv_get(e, sym));
+        }
+        break;
+      }
+
+      case OP_NIL:
+        lvm_push(lval_sexpr());
+        break;
+
+      case OP_EVAL: {
+        fr->pc = pc;
+        lval* x = lvm_value(e, lvm_pop());
+        if (!x) { return NULL; }
+        lvm_push(x);
+        break;
+      }
+
+      case OP_CALL:
+      case OP_TAIL: {
+        int tail = pc[-1] == OP_TAIL;
+        int n    = *pc++;
+        fr->pc = pc;
+        lgc_poll();
+
+        lval* g;
+        lval* a;
+        lval* x = lvm_args(n, &g, &a);
+        if (!x) {
+          x = lvm_apply(fr, g, a, tail);
+          if (!x) { return NULL; }
+
+          /* A builtin can evaluate in frames of its own, which can move
+             ours, but they are all gone by the time it returns */
+          fr = lvm_top();
+        }
+        lvm_push(x);
+        break;
+      }
+
+      case OP_IF: {
+        lval* f_if = vm.stack[vm.sp - 2];
+        lval* cond = vm.stack[vm.sp - 1];
+        if (LVAL_TYPE(f_if) == LVAL_FUN && LVAL_IS_BUILTIN(f_if) &&
+          f_if->builtin == builtin_if && LVAL_TYPE(cond) == LVAL_NUM)
+        {
+          vm.sp -= 2;
+          lval_del(f_if);
+          long t = LVAL_NUM_VAL(cond);
+          lval_del(cond);
+          pc = t ? pc + 4 : c->ops + pc[2];
+          break;
+        }
+
+        /* Call whatever 'if' is with the branches, carrying on after
+           the code compiled for them */
+        lvm_push(lval_ref(c->consts[pc[0]]));
+        lvm_push(lval_ref(c->consts[pc[1]]));
+        pc = c->ops + pc[3];
+        fr->pc = pc;
+        lgc_poll();
+
+        lval* g;
+        lval* a;
+        lval* x = lvm_args(4, &g, &a);
+        if (!x) {
+          x = lvm_apply(fr, g, a, 0);
+          if (!x) { return NULL; }
+          fr = lvm_top();
+        }
+        lvm_push(x);
+        break;
+      }
+
+      case OP_JUMP:
+        pc = c->ops + *pc;
+        break;
+
+      case OP_FOLD: {
+        lfold* fd = &c->folds[pc[0]];
+        if (fd->version != lenv_version) {
+          fd->holds   = lvm_holds(e, c, fd);
+          fd->version = lenv_version;
+        }
+        if (!fd->holds) {
+          pc += 2;
+          break;
+        }
+        if (fd->val) { lvm_push(lval_ref(fd->val)); }
+        pc = c->ops + pc[1];
+        break;
+      }
+
+      case OP_RET:
+        return lvm_pop();
+    }
+  }
+}
+
+/* Run frames until the one pushed above bottom returns, giving the value
+   of each one that is done to the frame below it */
+static lval* lvm_loop(int bottom)
+{
+  for (;;) {
+    lframe* fr = lvm_top();
+    lval*   x  = fr->c ? lvm_exec(fr) : lvm_walk(fr);
+    if (!x) { continue; }
+
+    fr = lvm_top();
+    vm.sp = fr->base;
+    lvm_release(fr);
+    vm.nframes--;
+
+    if (vm.nframes == bottom) { return x; }
+
+    fr = lvm_top();
+    if (fr->c) {
+      lvm_push(x);
+    } else {
+      fr->v->cell[fr->i++] = x;
+      if (!LVAL_IS_FIXNUM(x)) { fr->v->flags &= ~LVAL_PACKED; }
+    }
+  }
+}
+
+lval* lval_eval(lenv* e, lval* v)
+{
+  lgc_poll();
+  int   bottom = vm.nframes;
+  lval* x      = lvm_value(e, v);
+  return x ? x : lvm_loop(bottom);
+}
+
+/* Run the body of the lambda f in the frame env from lval_bind. Takes
+   over the reference to env */
+lval* lvm_run(lval* f, lval* env)
+{
+  int     bottom = vm.nframes;
+  lframe* fr     = lvm_frame(env->vars);
+  if (!fr) {
+    lval_del(env);
+    return lvm_too_deep();
+  }
+  lvm_start(fr, f, env);
+  return lvm_loop(bottom);
+}
+
+int lvm_set(char* knob, long value)
+{
+  if (value < 0) { return 0; }
+
+  if (strcmp(knob, "depth") == 0) {
+    vm.limit = value;
+    return 1;
+  }
+  return 0;
+}
+
+void lvm_print(void)
+{
+  printf("vm : %d frames in use, deepest %d, depth limit %lu\n",
+    vm.nframes, vm.deepest, vm.limit);
+  printf("vm : %lu expressions folded\n", vm.folded);
+}
+
+void lvm_print_cache(void)
+{
+  unsigned long total = vm.hits + vm.misses;
+  printf("cache : %lu hits, %lu misses (%.1f%% hit), version %lu\n",
+    vm.hits, vm.misses, total ? 100.0 * vm.hits / total : 0.0,
+    lenv_version);
+}
+
+void lvm_cleanup(void)
+{
+  free(vm.stack);
+  free(vm.frames);
+  vm.stack  = NULL;
+  vm.frames = NULL;
+  vm.sp = vm.cap = 0;
+  vm.nframes = vm.fcap = 0;
+}
+
+/* #endregion Virtual Machine */